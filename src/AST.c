@@ -18,12 +18,15 @@
 #include "AST.h"
 #include "lex.h"
 #include "codegen.h"
+#include "arena.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 static void printTreeHelper(struct ASTLinkedNode *curr, int tabs);
-static void freeTreeHelper(struct ASTLinkedNode *n);
+
+// every node of the tree being compiled lives here, so dropping a tree is one reset
+static struct Arena treeArena;
 
 void printTree(struct AST *tree)
 {
@@ -68,50 +71,57 @@ static void printTreeHelper(struct ASTLinkedNode *curr, int tabs)
     printf("\n");
 }
 
+/*
+ * EFFECTS: produces memory that lives exactly as long as the current tree.
+*/
+void *treeAlloc(size_t size)
+{
+    return arenaAlloc(&treeArena, size);
+}
+
 struct ASTNode *newAstNode(enum NodeType type)
 {
-    struct ASTNode *ans = malloc(sizeof(*ans));
+    struct ASTNode *ans = treeAlloc(sizeof(*ans));
     ans->type = type;
     ans->children = NULL;
     ans->isConstant = 0;
+    ans->hasSideEffects = 0;
     ans->startIndex = 0;
     ans->endIndex = 0;
+    ans->symbol = -1;
     ans->isStatic = 0;
     return ans;
 }
 
 struct ASTLinkedNode *newLinkedAstNode(enum NodeType type)
 {
-    struct ASTLinkedNode *ans = malloc(sizeof(*ans));
+    struct ASTLinkedNode *ans = treeAlloc(sizeof(*ans));
     ans->val.type = type;
     ans->val.children = NULL;
     ans->val.isConstant = 0;
+    ans->val.hasSideEffects = 0;
     ans->val.startIndex = 0;
     ans->val.endIndex = 0;
+    ans->val.symbol = -1;
     ans->val.isStatic = 0;
     ans->next = NULL;
     return ans;
 }
 
-static void freeTreeHelper(struct ASTLinkedNode *n)
+/*
+ * EFFECTS: frees t and everything else allocated with treeAlloc since the last freeTree.
+ * Only one tree may be alive at a time.
+*/
+void freeTree(struct AST *t)
 {
-    if (n == NULL) {
-        return;
-    }
-    if (n->val.children != NULL) {
-        struct ASTLinkedNode *t, *c = n->val.children;
-        while (c != NULL) {
-            t = c->next;
-            freeTreeHelper(c);
-            c = t;
-        }
-    }
-    free(n);
+    (void)t;
+    arenaReset(&treeArena);
 }
 
-void freeTree(struct AST *t)
+/*
+ * EFFECTS: hands the memory behind all trees back to the system. Call once we're done compiling.
+*/
+void freeTreeArena()
 {
-    freeTreeHelper(t->root);
-    free(t);
+    arenaFree(&treeArena);
 }
-
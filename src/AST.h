@@ -22,6 +22,8 @@ enum NodeType {
     RETURN_DIRECTIVE,
     IF_EXPR,
     WHILE_LOOP,
+    INLINED_CALL,
+    TAIL_LOOP,
     NUMBER_LITERAL
 };
 
@@ -43,21 +45,26 @@ static const char *NODE_TYPE_STRINGS[] = {
     "return directive",
     "if statement",
     "while loop",
+    "inlined call",
+    "tail call loop",
     "number literal"
 };
 
 struct ASTNode {
     enum NodeType type;
     int isConstant;
+    int hasSideEffects; // evaluating this could call a function, set by analysis
     struct ASTLinkedNode *children;
     size_t startIndex;
     size_t endIndex;
+    int symbol; // interned name of identifiers and declarations, -1 otherwise
     union {
         struct {
             // for variable declarations
             int isStatic;
             int frameIndex;
             int isParam;
+            int reg; // register it lives in for the whole function, -1 if in memory
         };
         enum TokenType operationType; // for expressions
         int val; // for constants
@@ -83,7 +90,9 @@ struct AST {
 
 void printTree(struct AST *);
 struct ASTNode *newAstNode(enum NodeType type);
+void *treeAlloc(size_t);
 struct ASTLinkedNode *newLinkedAstNode(enum NodeType type);
 void freeTree(struct AST *);
+void freeTreeArena(void);
 
 #endif
\ No newline at end of file
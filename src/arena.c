@@ -0,0 +1,108 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ * 
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>. 
+ * 
+ * A bump-pointer arena. Everything allocated from one is thrown away together,
+ * which is exactly the lifetime of an AST: built once, read by every pass, dropped.
+ * Nothing is freed individually - there is no arenaFree for a single allocation.
+ *
+ * Chunks are kept around on reset so the next compilation reuses them.
+*/
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN (_Alignof(max_align_t))
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) unsigned char data[];
+};
+
+static struct ArenaChunk *newChunk(size_t minSize);
+
+/*
+ * EFFECTS: produces size bytes of uninitialized, suitably aligned memory that lives until
+ * the arena is reset or freed.
+*/
+void *arenaAlloc(struct Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    struct ArenaChunk *c = arena->curr;
+    while (c == NULL || c->size - c->used < size) {
+        if (c != NULL && c->next != NULL) {
+            // left over from before a reset - reuse it if it fits
+            c = c->next;
+            c->used = 0;
+            continue;
+        }
+        struct ArenaChunk *fresh = newChunk(size);
+        if (c == NULL) {
+            arena->first = fresh;
+        } else {
+            fresh->next = c->next;
+            c->next = fresh;
+        }
+        c = fresh;
+    }
+    arena->curr = c;
+    void *ans = c->data + c->used;
+    c->used += size;
+    return ans;
+}
+
+/*
+ * EFFECTS: forgets everything allocated from arena in O(1). The memory is kept for reuse.
+*/
+void arenaReset(struct Arena *arena)
+{
+    arena->curr = arena->first;
+    if (arena->first != NULL) {
+        arena->first->used = 0;
+    }
+}
+
+/*
+ * EFFECTS: gives all of arena's memory back to the system.
+*/
+void arenaFree(struct Arena *arena)
+{
+    struct ArenaChunk *t, *c = arena->first;
+    while (c != NULL) {
+        t = c->next;
+        free(c);
+        c = t;
+    }
+    arena->first = arena->curr = NULL;
+}
+
+static struct ArenaChunk *newChunk(size_t minSize)
+{
+    size_t size = minSize > ARENA_CHUNK_SIZE ? minSize : ARENA_CHUNK_SIZE;
+    struct ArenaChunk *c = malloc(sizeof(*c) + size);
+    if (c == NULL) {
+        fputs("Out of memory\n", stderr);
+        exit(1);
+    }
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
@@ -0,0 +1,17 @@
+#ifndef SML_ARENA_H
+#define SML_ARENA_H
+
+#include <unistd.h>
+
+struct ArenaChunk;
+
+struct Arena {
+    struct ArenaChunk *first;
+    struct ArenaChunk *curr;
+};
+
+void *arenaAlloc(struct Arena *, size_t);
+void arenaReset(struct Arena *);
+void arenaFree(struct Arena *);
+
+#endif
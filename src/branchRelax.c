@@ -0,0 +1,76 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ *
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Branch relaxation. Codegen branches with the short br / beq / bgt everywhere, which only
+ * reach -256..+254 bytes from the instruction after them. This pass lays the IR out to find
+ * every branch that can't reach its label and marks just those long, for emitAssembly to write
+ * the long form of:
+ *   br X              ->  j X
+ *   beq rA, X         ->  beq rA, RBnT / br RBn / RBnT: j X / RBn:
+ * Widening only ever moves labels further apart, so laying out again until nothing else
+ * needs widening always finishes.
+*/
+#include "branchRelax.h"
+
+#define BRANCH_MIN (-256)
+#define BRANCH_MAX 254
+
+static int layout(struct IRProgram *prog, int widen);
+
+/*
+ * MODIFIES: prog
+ * EFFECTS: marks every short branch in prog that can't reach its target as long, and gives
+ *   every block its address.
+*/
+void relaxBranches(struct IRProgram *prog)
+{
+    layout(prog, 0);
+    while (layout(prog, 1)) {
+        layout(prog, 0);
+    }
+}
+
+/*
+ * MODIFIES: prog
+ * EFFECTS: assigns every block its address, given which branches are long so far. If widen,
+ *   instead uses the addresses from last time to mark branches long, and produces whether it
+ *   marked any.
+*/
+static int layout(struct IRProgram *prog, int widen)
+{
+    int changed = 0;
+    unsigned long addr = 0;
+    for (struct IRBlock *b = prog->blocks; b != NULL; b = b->next) {
+        if (b->first != NULL && b->first->op == IR_POS) addr = b->first->imm;
+        if (!widen) b->addr = addr;
+        for (struct IRInstr *i = b->first; i != NULL; i = i->next) {
+            if (i->op == IR_POS) addr = i->imm;
+            int size = instrSize(i); // as laid out, even if it gets widened now
+            int isBranch = i->op == IR_BR || i->op == IR_BEQ || i->op == IR_BGT;
+            if (widen && isBranch && !i->isLong) {
+                struct IRBlock *target = (size_t)i->symbol < prog->symbolLimit ? prog->blockOfLabel[i->symbol] : NULL;
+                long distance = target != NULL ? (long)target->addr - (long)(addr + 2) : 0;
+                if (target == NULL || distance < BRANCH_MIN || distance > BRANCH_MAX) {
+                    i->isLong = 1;
+                    changed = 1;
+                }
+            }
+            addr += size;
+        }
+    }
+    return changed;
+}
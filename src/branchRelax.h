@@ -0,0 +1,8 @@
+#ifndef SML_BRANCH_RELAX_H
+#define SML_BRANCH_RELAX_H
+
+#include "ir.h"
+
+void relaxBranches(struct IRProgram *prog);
+
+#endif
@@ -26,12 +26,17 @@
 #include <stdlib.h>
 
 #include "codegen.h"
+#include "ir.h"
+#include "regAlloc.h"
 #include "AST.h"
+#include "intern.h"
 
 #define DEFAULT_DATA_TOP (0x2000)
 
 #define STACK_WORDS (512)
 #define DEFAULT_STACK_TOP (0x3000)
+// ld and st offsets only reach 60, the first this many words at r5
+#define REACHABLE_WORDS (16)
 
 static void codegenProgram(struct ASTLinkedNode *program);
 static void codegenFuncDecl(struct ASTLinkedNode *decl);
@@ -40,19 +45,79 @@ static void codegenFuncCall(struct ASTLinkedNode *call, int regDest);
 static void codegenIdentRef(struct ASTLinkedNode *varref, int regDest);
 static void codegenWhileLoop(struct ASTLinkedNode *loop);
 static void codegenIf(struct ASTLinkedNode *ifExpr);
+static void codegenInlinedCall(struct ASTLinkedNode *call);
+static void codegenTailLoop(struct ASTLinkedNode *loop);
+static void codegenTailCall(struct ASTLinkedNode *call);
+static int isTailCall(struct ASTLinkedNode *ret);
+static int readsVar(struct ASTLinkedNode *expr, struct ASTLinkedNode *var);
+static int mentionsVar(struct ASTLinkedNode *node, struct ASTLinkedNode *var);
 static void codegenDirectAssign(struct ASTLinkedNode *assignment);
+static void codegenLocalAssign(struct ASTLinkedNode *var, struct ASTLinkedNode *value);
+static void codegenRegisterAssign(struct ASTLinkedNode *var, struct ASTLinkedNode *value);
+static void codegenIndirectAssign(struct ASTLinkedNode *assignment);
+static void codegenDeref(struct ASTLinkedNode *address, int destReg);
+static struct ASTLinkedNode *splitOffset(struct ASTLinkedNode *address, int *offset);
+static int varRegister(struct ASTLinkedNode *expr);
+static int frameOffset(struct ASTLinkedNode *var);
+static int frameSpan(struct ASTLinkedNode *decl, struct RegAllocation *alloc);
+static void measureCalls(struct ASTLinkedNode *node, int saves, int inTailLoop);
+static void passArgs(struct ASTLinkedNode *args);
+static int argRank(struct ASTLinkedNode *arg, int index);
+static int argsConflict(struct ASTLinkedNode *arg, struct ASTLinkedNode *later);
+static void storeArg(struct ASTLinkedNode *arg, int index);
+static void emitAddConstant(int reg, int constant, int tempReg);
+static int addConstantCost(int constant);
 static void codegenExpr(struct ASTLinkedNode *expr, int regDest);
 static void codegenInfixOperation(struct ASTLinkedNode *expr, int regDest);
 static void codegenPrefixOperation(struct ASTLinkedNode *expr, int reg);
+static void applyInfixOperation(enum TokenType op, int left, int right);
+static void applyReversedOperation(enum TokenType op, int left, int right);
+static int isReversible(enum TokenType op);
+static int isLeaf(struct ASTLinkedNode *expr);
 static void codegenMinus(int left, int right);
-static void codegenDivide(int left, int right);
-static void codegenModulus(int left, int right);
-static void codegenLeftShift(int left, int right);
-static void codegenRightShift(int left, int right);
-static void codegenNotEquals(int left, int right);
+static void codegenDynamicDivision(int left, int right, int wantRemainder);
+static void codegenDynamicShift(int left, int right, int isLeft);
+static void codegenComparison(enum TokenType op, int left, int right);
 static void codegenOr(int left, int right);
 static void codegenAnd(int left, int right);
 static void codegenDynamicMultiplication(int left, int right);
+static void codegenConstMultiplication(int reg, int constant, int tempReg);
+static void codegenConstDivision(int reg, int divisor, int wantRemainder);
+static int acquireScratch(int destReg, int otherReg, int count, int *regs);
+static void releaseScratch(int *regs, int count, int saved);
+
+/*
+ * The long dynamic operations, which can be emitted inline or called as a shared runtime routine.
+*/
+enum RuntimeRoutine {
+    RT_MUL, RT_DIV, RT_MOD, RT_SHL, RT_SHR, RT_COUNT
+};
+static const char *runtimeNames[RT_COUNT] = {"_rt_mul", "_rt_div", "_rt_mod", "_rt_shl", "_rt_shr"};
+
+static void codegenLongOperation(enum RuntimeRoutine routine, int left, int right);
+static void emitLongOperation(enum RuntimeRoutine routine, int left, int right);
+static int useRuntimeRoutine(enum RuntimeRoutine routine);
+static void codegenRuntimeCall(enum RuntimeRoutine routine, int left, int right);
+static void codegenRuntimeRoutines();
+
+/*
+ * Everything a condition can branch on, once the comparison is reduced to a single register.
+*/
+enum Relation {
+    REL_EQ0, REL_NE0, REL_GT0, REL_LE0, REL_GE0, REL_LT0
+};
+
+static void codegenBranch(struct ASTLinkedNode *cond, int sense, const char *target, int reg);
+static void codegenLogicalValue(struct ASTLinkedNode *expr, int destReg);
+static enum Relation compareRegs(enum TokenType op, int left, int right, int *testReg);
+static enum Relation negateRelation(enum Relation rel);
+static enum Relation zeroRelation(enum TokenType op);
+static enum TokenType mirrorComparison(enum TokenType op);
+static void emitBranchTo(enum Relation rel, int reg, const char *target);
+static int branchCost(enum Relation rel);
+static int isComparison(enum TokenType op);
+static void countRuntimeSites(struct ASTLinkedNode *node, int inLoop);
+static int runtimeRoutineFor(struct ASTLinkedNode *expr);
 
 static char startAsm[] = ".pos 0x1000\n"
     "_start:\n"
@@ -82,21 +147,58 @@ static char restoreAllGPRegs[] = "\nld (r5), r7\t\t# restore all regs\n"
     "ld (r5), r0\n"
     "inca r5\n\n";
 
-void generateCode(struct AST *tree)
+static FILE *out; // instructions go here as text, for buildIR to read into blocks
+static enum OptLevel optLevel = OPT_DEFAULT;
+static int loopDepth = 0;
+static int regCeiling = LAST_VAR_REG + 1; // temporaries go in r0 up to here, variables from here to r4
+static int emittingRuntime = 0;
+static int runtimeSites[RT_COUNT];
+static int runtimeSitesOutsideLoops[RT_COUNT];
+static int runtimeUsed[RT_COUNT];
+
+/*
+ * EFFECTS: produces the IR for the program in tree. Free it with freeIR.
+*/
+struct IRProgram *generateCode(struct AST *tree, enum OptLevel level)
 {
+    optLevel = level;
+    for (int i = 0; i < RT_COUNT; i++) {
+        runtimeSites[i] = runtimeSitesOutsideLoops[i] = runtimeUsed[i] = 0;
+    }
+    countRuntimeSites(tree->root, 0);
+
+    char *text;
+    size_t len;
+    out = open_memstream(&text, &len);
+    if (out == NULL) {
+        fputs("Out of memory generating code\n", stderr);
+        exit(1);
+    }
     codegenProgram(tree->root);
+    fclose(out);
+    struct IRProgram *prog = buildIR(text);
+    free(text);
+    return prog;
 }
 
 static int uniqueNum = 0;
 static int frameArgOffset = 0;
 static int entireFrameOffset = 0;
-static char *fnname;
+static int outgoingWords; // words at the bottom of the frame for the arguments of calls it makes
+static int callSaveWords; // words above those that calls save temporaries in
+static int freeArgWords; // how many of the outgoing words no call is still filling in
+static int savesBusy; // a call has saved temporaries in the save words that it still needs
+static const char *fnname;
+static struct ASTLinkedNode *currentFn;
+static int tailLoop = -1; // label number of the function's TAIL_LOOP, -1 if it has none
+static int inlineExit = -1; // label number a return goes to inside an inlined call, -1 outside
 
 /*
  * EFFECTS: outputs assembler for the program organized as such:
  *   .pos 0x1000
  *   _start
  *   fn defs
+ *   runtime routines
  * 
  *   .pos <data top>
  *   global vars
@@ -106,7 +208,7 @@ static char *fnname;
 */
 static void codegenProgram(struct ASTLinkedNode *program)
 {
-    fputs(startAsm, stdout);
+    fputs(startAsm, out);
     struct ASTLinkedNode * child;
     for (child = program->val.children; child != NULL; child = child->next) {
         if (child->val.children->val.type == FN_DECL) {
@@ -115,53 +217,90 @@ static void codegenProgram(struct ASTLinkedNode *program)
             //printf("%s", NODE_TYPE_STRINGS[child->val.type]);
         }
     }
+    codegenRuntimeRoutines();
     // TODO: keep track of bytes so far so there is no hope of a data/stack section being on top of something else
-    fprintf(stdout, ".pos 0x%X\n", DEFAULT_DATA_TOP);
+    fprintf(out, ".pos 0x%X\n", DEFAULT_DATA_TOP);
     for (child = program->val.children; child != NULL; child = child->next) {
         if (child->val.children->val.type == VAR_DECL) {
-            char *name = calloc(child->val.children->val.children->val.endIndex - child->val.children->val.children->val.startIndex + 1, sizeof(char));
-            getInputSubstr(name, child->val.children->val.children->val.startIndex, child->val.children->val.children->val.endIndex);
-            fprintf(stdout, "%s: .long 0\n", name);
-            free(name);
+            fprintf(out, "%s: .long 0\n", symbolName(child->val.children->val.symbol));
         }
     }
 
-    fprintf(stdout, ".pos 0x%X\n_stackTop:\n", DEFAULT_STACK_TOP);
+    fprintf(out, ".pos 0x%X\n_stackTop:\n", DEFAULT_STACK_TOP);
     for (size_t i = 0; i < STACK_WORDS; i++) {
-        fputs(".long 0\n", stdout);
+        fputs(".long 0\n", out);
     }
-    fputs("_stackBottom: .long 0\n", stdout);
+    fputs("_stackBottom: .long 0\n", out);
 }
 
 /*
- * 
+ * A function's frame, from r5 up once the prologue is done:
+ *   arguments for the calls it makes
+ *   temporaries saved around those calls
+ *   local variables that live in memory
+ *   variables' registers it saves, then r6 if it makes calls
+ *   its own arguments, in its caller's frame. The caller only fills in the stack ones, the
+ *   register ones are there for the function to keep them in if it doesn't give them a register.
 */
 static void codegenFuncDecl(struct ASTLinkedNode *decl)
 {
-    fnname = calloc(decl->val.children->val.endIndex - decl->val.children->val.startIndex + 1, sizeof(char));
-    getInputSubstr(fnname, decl->val.children->val.startIndex, decl->val.children->val.endIndex);
-    fprintf(stdout, "%s:\n", fnname);
+    struct RegAllocation alloc;
+    struct ASTLinkedNode *param;
+    allocateRegisters(decl, &alloc);
+    regCeiling = alloc.regCeiling;
+
+    fnname = symbolName(decl->val.symbol);
+    currentFn = decl;
+    outgoingWords = callSaveWords = 0;
+    measureCalls(decl->val.children->next->next, 0, 0);
+    if (frameSpan(decl, &alloc) > REACHABLE_WORDS) {
+        // the call area would push the variables out of reach, so calls push what they need
+        outgoingWords = callSaveWords = 0;
+    }
+    freeArgWords = outgoingWords;
+    int frameWords = alloc.frameVars + outgoingWords + callSaveWords;
+    fprintf(out, "%s:\n", fnname);
     if (decl->val.clobbersReturn) {
-        fputs("deca r5\t\t# save r6\nst r6, (r5)\n", stdout);
+        fputs("deca r5\t\t# save r6\nst r6, (r5)\n", out);
+        frameArgOffset += 4;
+    }
+    // variables' registers are callee saved
+    for (int r = LAST_VAR_REG; r >= FIRST_VAR_REG; r--) {
+        if (!(alloc.savedRegs & (1 << r))) continue;
+        fprintf(out, "deca r5\t\t# save r%d\nst r%d, (r5)\n", r, r);
         frameArgOffset += 4;
     }
-    if (decl->val.frameVars > 0) {
-        fprintf(stdout, "ld $-%d, r7\t\t# allocate local vars\nadd r7, r5\n\n", 4*decl->val.frameVars);
-        frameArgOffset += 4*decl->val.frameVars;
+    if (frameWords > 0) {
+        fprintf(out, "ld $-%d, r7\t\t# allocate local vars and call area\nadd r7, r5\n\n", 4*frameWords);
+        frameArgOffset += 4*alloc.frameVars;
+    }
+    for (param = decl->val.children->next->val.children; param != NULL; param = param->next) {
+        if (param->val.frameIndex >= ARG_REGS) {
+            if (param->val.reg >= 0) fprintf(out, "ld %d(r5), r%d\n", frameOffset(param), param->val.reg);
+        } else if (param->val.reg >= 0) {
+            fprintf(out, "mov r%d, r%d\n", param->val.frameIndex, param->val.reg);
+        } else if (mentionsVar(decl->val.children->next->next, param)) {
+            fprintf(out, "st r%d, %d(r5)\n", param->val.frameIndex, frameOffset(param));
+        }
     }
     codegenSingleCommand(decl->val.children->next->next);
-    fprintf(stdout, "%s_RET:\n", fnname);
-    if (decl->val.frameVars > 0) {
-        fprintf(stdout, "\nld $%d, r7\t\t# de-alloc local vars\nadd r7, r5\n\n", 4*decl->val.frameVars);
-        frameArgOffset -= 4*decl->val.frameVars;
+    fprintf(out, "%s_RET:\n", fnname);
+    if (frameWords > 0) {
+        fprintf(out, "\nld $%d, r7\t\t# de-alloc local vars and call area\nadd r7, r5\n\n", 4*frameWords);
+        frameArgOffset -= 4*alloc.frameVars;
+    }
+    for (int r = FIRST_VAR_REG; r <= LAST_VAR_REG; r++) {
+        if (!(alloc.savedRegs & (1 << r))) continue;
+        fprintf(out, "ld (r5), r%d\t\t# restore r%d\ninca r5\n", r, r);
+        frameArgOffset -= 4;
     }
 
     if (decl->val.clobbersReturn) {
-        fputs("ld (r5), r6\t\t# restore r6\ninca r5\n", stdout);
+        fputs("ld (r5), r6\t\t# restore r6\ninca r5\n", out);
         frameArgOffset -= 4;
     }
-    free(fnname);
-    fputs("j (r6)\t\t# return\n\n", stdout);
+    fputs("j (r6)\t\t# return\n\n", out);
+    regCeiling = LAST_VAR_REG + 1;
 }
 
 /*
@@ -170,14 +309,22 @@ static void codegenFuncDecl(struct ASTLinkedNode *decl)
 static void codegenSingleCommand(struct ASTLinkedNode *command)
 {
     if (command->val.type == RETURN_DIRECTIVE) {
+        if (isTailCall(command)) {
+            codegenTailCall(command->val.children);
+            return;
+        }
         if (command->val.children) {
             codegenExpr(command->val.children, 0);
         }
-        fprintf(stdout, "j %s_RET\n", fnname);
+        if (inlineExit >= 0) {
+            fprintf(out, "br INL%dE\n", inlineExit);
+        } else {
+            fprintf(out, "br %s_RET\n", fnname);
+        }
         return;
     }
     struct ASTLinkedNode *temp, *child = command->val.children;
-    int offset;
+    int reg;
     switch(child->val.type) {
 
     case CONST_DECL:
@@ -186,10 +333,16 @@ static void codegenSingleCommand(struct ASTLinkedNode *command)
         if (!child->val.children->next) {
             return;
         }
-        codegenExpr(child->val.children->next, 0);
-        offset = child->val.frameIndex*4;
-        if (child->val.isParam) offset += frameArgOffset;
-        fprintf(stdout, "st r0, %d(r5)\n", offset + entireFrameOffset);
+        if (child->val.reg >= 0) {
+            codegenRegisterAssign(child, child->val.children->next);
+            return;
+        }
+        reg = varRegister(child->val.children->next);
+        if (reg < 0) {
+            codegenExpr(child->val.children->next, 0);
+            reg = 0;
+        }
+        fprintf(out, "st r%d, %d(r5)\n", reg, frameOffset(child));
         return;
     case IF_EXPR:
         codegenIf(child);
@@ -197,6 +350,12 @@ static void codegenSingleCommand(struct ASTLinkedNode *command)
     case WHILE_LOOP:
         codegenWhileLoop(child);
         return;
+    case INLINED_CALL:
+        codegenInlinedCall(child);
+        return;
+    case TAIL_LOOP:
+        codegenTailLoop(child);
+        return;
     case COMMAND:
         for (temp = child->val.children; temp != NULL; temp = temp->next) {
             codegenSingleCommand(temp);
@@ -206,10 +365,8 @@ static void codegenSingleCommand(struct ASTLinkedNode *command)
         codegenDirectAssign(child);
         return;
     case INDIRECT_ASSIGN:
-        codegenExpr(child->val.children, 0);
-        codegenExpr(child->val.children->next, 1);
-        fputs("st r1, (r0)\n", stdout);
-        break;
+        codegenIndirectAssign(child);
+        return;
     case FUNC_CALL:
         codegenFuncCall(child, 0);
         return;
@@ -220,106 +377,641 @@ static void codegenSingleCommand(struct ASTLinkedNode *command)
     }
 }
 
+/*
+ * Calls call and leaves what it returns in regDest. The callee only preserves variables'
+ * registers, so the temporaries below regDest, which are all in use, are saved around the call.
+ *
+ * They go in the save words the prologue set aside, and the arguments in the outgoing words at
+ * the bottom of the frame. Those have to be right at r5 for the callee, so while something is
+ * pushed the call pushes its own like it used to. It does the same if an enclosing call is part
+ * way through filling in words it needs, which usually leaves the register arguments' words
+ * free: the callee is what puts anything in those.
+*/
 static void codegenFuncCall(struct ASTLinkedNode *call, int regDest)
 {
-    struct ASTLinkedNode *temp;
+    int paramCount = call->val.children->val.definition->val.paramCount;
+    int wasFree = freeArgWords, wasSavesBusy = savesBusy;
+    int fixedSaves = !savesBusy && regDest <= callSaveWords;
+    for (int r = 0; r < regDest; r++) {
+        if (fixedSaves) {
+            fprintf(out, "st r%d, %d(r5)\t\t# save r%d\n", r, 4*(outgoingWords + r) + entireFrameOffset, r);
+        } else {
+            fprintf(out, "deca r5\t\t# save r%d\nst r%d, (r5)\n", r, r);
+            entireFrameOffset += 4;
+        }
+    }
+    savesBusy = savesBusy || (fixedSaves && regDest > 0);
+    int fixedArgs = entireFrameOffset == 0 && paramCount <= freeArgWords;
+    if (!fixedArgs && paramCount > 0) {
+        fprintf(out, "ld $-%d, r0\t\t# alloc args\nadd r0, r5\n\n", 4*paramCount);
+        entireFrameOffset += 4*paramCount;
+    }
+    passArgs(call->val.children->next->val.children);
+    freeArgWords = wasFree;
+    savesBusy = wasSavesBusy;
+    fprintf(out, "gpc $6, r6\nj %s\n", symbolName(call->val.children->val.symbol));
+    if (!fixedArgs && paramCount > 0) {
+        fprintf(out, "ld $%d, r7\t\t# dealloc args\nadd r7, r5\n\n", 4*paramCount);
+        entireFrameOffset -= 4*paramCount;
+    }
     if (regDest != 0) {
-        fputs("deca r5\t\t# Save r0\nst r0, (r5)\n\n", stdout);
-        entireFrameOffset += 4;
+        fprintf(out, "mov r0, r%d\n", regDest);
+    }
+    for (int r = regDest - 1; r >= 0; r--) {
+        if (fixedSaves) {
+            fprintf(out, "ld %d(r5), r%d\t\t# restore r%d\n", 4*(outgoingWords + r) + entireFrameOffset, r, r);
+        } else {
+            fprintf(out, "ld (r5), r%d\t\t# restore r%d\ninca r5\n", r, r);
+            entireFrameOffset -= 4;
+        }
+    }
+}
+
+/*
+ * Puts args where the callee wants them: the first ARG_REGS in r0 and up, the rest in the words
+ * at r5. The register ones have to be worked out after the ones in memory, which need r0, and
+ * a stack argument that makes a call is best worked out before anything is in the words its
+ * call might need. So the arguments go by argRank if no two that would swap places conflict.
+ * Otherwise they go in order, except that register arguments nothing after them conflicts with
+ * still wait until the end. The rest go in their words and get loaded back.
+*/
+static void passArgs(struct ASTLinkedNode *args)
+{
+    struct ASTLinkedNode *arg, *later;
+    int i, j, rank, reorder = 1, waiting = 0;
+    for (arg = args, i = 0; arg != NULL; arg = arg->next, i++) {
+        int waits = i < ARG_REGS;
+        for (later = arg->next, j = i + 1; later != NULL; later = later->next, j++) {
+            if (!argsConflict(arg, later)) continue;
+            waits = 0;
+            if (argRank(later, j) < argRank(arg, i)) reorder = 0;
+        }
+        if (waits) waiting |= 1 << i;
+    }
+    if (reorder) {
+        for (rank = 0; rank < 3; rank++) {
+            for (arg = args, i = 0; arg != NULL; arg = arg->next, i++) {
+                if (argRank(arg, i) != rank) continue;
+                if (i < ARG_REGS) codegenExpr(arg, i);
+                else storeArg(arg, i);
+            }
+        }
+        return;
+    }
+    for (arg = args, i = 0; arg != NULL; arg = arg->next, i++) {
+        if (!(waiting & (1 << i))) storeArg(arg, i);
     }
-    if (call->val.children->val.definition->val.paramCount > 0) {
-        fprintf(stdout, "ld $-%d, r0\t\t# alloc args\nadd r0, r5\n\n", 4*call->val.children->val.definition->val.paramCount);
-        entireFrameOffset += 4*call->val.children->val.definition->val.paramCount;
+    for (arg = args, i = 0; arg != NULL && i < ARG_REGS; arg = arg->next, i++) {
+        if (waiting & (1 << i)) codegenExpr(arg, i);
+        else fprintf(out, "ld %d(r5), r%d\n", 4*i, i);
+    }
+}
+
+/*
+ * EFFECTS: returns when passArgs would like to work out the index-th argument: 0 for stack
+ *   arguments that make calls, 1 for the other stack arguments, 2 for register arguments
+*/
+static int argRank(struct ASTLinkedNode *arg, int index)
+{
+    if (index < ARG_REGS) return 2;
+    return arg->val.hasSideEffects ? 0 : 1;
+}
+
+/*
+ * EFFECTS: returns whether a call made working out one of arg and later could change what the
+ *   other works out to, so they have to go in order
+*/
+static int argsConflict(struct ASTLinkedNode *arg, struct ASTLinkedNode *later)
+{
+    return (arg->val.hasSideEffects && !onlyReadsLocals(later))
+        || (later->val.hasSideEffects && !onlyReadsLocals(arg));
+}
+
+/*
+ * Puts arg in the index-th of the words at r5, which calls made after can't use then.
+*/
+static void storeArg(struct ASTLinkedNode *arg, int index)
+{
+    int reg = varRegister(arg);
+    if (reg < 0) {
+        codegenExpr(arg, 0);
+        reg = 0;
     }
+    fprintf(out, "st r%d, %d(r5)\n", reg, 4*index);
+    if (index < freeArgWords) freeArgWords = index;
+}
+
+/*
+ * Sizes the call area for the calls under node: enough words for the most arguments any of
+ * them passes, and for the temporaries the one that saves the most might have to. A call that
+ * is an operand might have all of them to save, and one that is an argument going in a register
+ * has the arguments in the registers before it. Self tail calls don't call anything.
+*/
+static void measureCalls(struct ASTLinkedNode *node, int saves, int inTailLoop)
+{
+    struct ASTLinkedNode *child;
     int i = 0;
-    for (temp = call->val.children->next->val.children; temp != NULL; temp = temp->next) {
-        codegenExpr(temp, 0);
-        fprintf(stdout, "st r0, %d(r5)\n", i++*4);
-    }
-    char *name = calloc(call->val.children->val.endIndex - call->val.children->val.startIndex + 1, sizeof(char));
-    getInputSubstr(name, call->val.children->val.startIndex, call->val.children->val.endIndex);
-    fprintf(stdout, "gpc $6, r6\nj %s\n", name);
-    free(name);
-    if (call->val.children->val.definition->val.paramCount > 0) {
-        fprintf(stdout, "ld $%d, r7\t\t# dealloc args\nadd r7, r5\n\n", 4*call->val.children->val.definition->val.paramCount);
-        entireFrameOffset -= 4*call->val.children->val.definition->val.paramCount;
+    if (node->val.type == NUMBER_LITERAL || node->val.type == IDENT_REF) return;
+    if (node->val.type == FUNC_CALL) {
+        int paramCount = node->val.children->val.definition->val.paramCount;
+        if (paramCount > outgoingWords) outgoingWords = paramCount;
+        if (saves > callSaveWords) callSaveWords = saves;
+        for (child = node->val.children->next->val.children; child != NULL; child = child->next, i++) {
+            measureCalls(child, i < ARG_REGS ? i : 0, inTailLoop);
+        }
+        return;
     }
-    if (regDest != 0) {
-        fprintf(stdout, "mov r0, r%d\n", regDest);
-        fputs("ld (r5), r0\t\t# restore r0\ninca r5\n\n", stdout);
-        entireFrameOffset -= 4;
+    if (node->val.type == RETURN_DIRECTIVE && inTailLoop && node->val.children != NULL
+            && node->val.children->val.type == FUNC_CALL
+            && node->val.children->val.children->val.definition == currentFn) {
+        for (child = node->val.children->val.children->next->val.children; child != NULL; child = child->next) {
+            measureCalls(child, 0, inTailLoop);
+        }
+        return;
+    }
+    inTailLoop = node->val.type == TAIL_LOOP || (inTailLoop && node->val.type != INLINED_CALL);
+    for (child = node->val.children; child != NULL; child = child->next) {
+        measureCalls(child, node->val.type == EXPR ? regCeiling - 1 : 0, inTailLoop);
     }
 }
 
 static void codegenIdentRef(struct ASTLinkedNode *varref, int regDest)
 {
-    if (varref->val.definition->val.isConstant) {
-        fprintf(stdout, "ld %d, r%d\n", varref->val.definition->val.val, regDest);
+    if (varref->val.definition->val.isStatic) {
+        fprintf(out, "ld $%s, r%d\nld (r%d), r%d\n", symbolName(varref->val.symbol), regDest, regDest, regDest);
         return;
     }
-    struct ASTLinkedNode *identifier = varref->val.definition->val.children;
-    if (varref->val.definition->val.isStatic) {
-        char *name = calloc(identifier->val.endIndex - identifier->val.startIndex + 1, sizeof(char));
-        getInputSubstr(name, identifier->val.startIndex, identifier->val.endIndex);
-        fprintf(stdout, "ld $%s, r%d\nld (r%d), r%d\n", name, regDest, regDest, regDest);
-        free(name);
+    if (varref->val.definition->val.reg >= 0) {
+        if (varref->val.definition->val.reg != regDest) {
+            fprintf(out, "mov r%d, r%d\n", varref->val.definition->val.reg, regDest);
+        }
         return;
     }
-    int offset = varref->val.definition->val.frameIndex*4;
-    if (varref->val.definition->val.isParam) offset += frameArgOffset;
-    fprintf(stdout, "ld %d(r5), r%d\n", offset + entireFrameOffset, regDest);
+    fprintf(out, "ld %d(r5), r%d\n", frameOffset(varref->val.definition), regDest);
     return;
 }
 
+/*
+ * EFFECTS: returns the register expr is sitting in if it is a variable allocated one, else -1
+*/
+static int varRegister(struct ASTLinkedNode *expr)
+{
+    if (expr->val.type != IDENT_REF || expr->val.definition->val.type != VAR_DECL
+            || expr->val.definition->val.isStatic) {
+        return -1;
+    }
+    return expr->val.definition->val.reg;
+}
+
+/*
+ * EFFECTS: returns how many words from r5 up decl's frame takes, up to its last parameter
+*/
+static int frameSpan(struct ASTLinkedNode *decl, struct RegAllocation *alloc)
+{
+    int words = alloc->frameVars + outgoingWords + callSaveWords + decl->val.paramCount;
+    if (decl->val.clobbersReturn) words++;
+    for (int r = FIRST_VAR_REG; r <= LAST_VAR_REG; r++) {
+        if (alloc->savedRegs & (1 << r)) words++;
+    }
+    return words;
+}
+
+/*
+ * REQUIRES: var is a local or parameter that lives in memory
+ * EFFECTS: returns var's offset from r5 right now
+*/
+static int frameOffset(struct ASTLinkedNode *var)
+{
+    int offset = var->val.frameIndex*4 + 4*(outgoingWords + callSaveWords);
+    if (var->val.isParam) offset += frameArgOffset;
+    return offset + entireFrameOffset;
+}
+
+/*
+ * Loops are rotated so the test sits at the bottom and each iteration takes just one branch,
+ * back to the top. The first test is a copy of it in front of the loop, or at -Os (which
+ * doesn't want the condition twice) a branch straight down to the bottom test.
+*/
 static void codegenWhileLoop(struct ASTLinkedNode *loop)
 {
-    // We always use j instead of br to avoid issues with labels being too far apart
     int number = uniqueNum++;
-    fprintf(stdout, "L%dS:\n", number);
-    codegenExpr(loop->val.children, 0);
-    fprintf(stdout, "beq r0, L%dEInter\n", number);
-    fprintf(stdout, "br L%dEInterEnd\n", number);
-    fprintf(stdout, "L%dEInter:\n", number);
-    fprintf(stdout, "j L%dE\n", number);
-    fprintf(stdout, "L%dEInterEnd:\n", number);
+    char start[32], exit[32];
+    snprintf(start, sizeof(start), "L%dS", number);
+    snprintf(exit, sizeof(exit), "L%dE", number);
+    loopDepth++;
+    if (optLevel == OPT_SIZE) {
+        fprintf(out, "br L%dT\n", number);
+    } else {
+        codegenBranch(loop->val.children, 0, exit, 0);
+    }
+    fprintf(out, "L%dS:\n", number);
     codegenSingleCommand(loop->val.children->next);
-    fprintf(stdout, "j L%dS\n", number);
-    fprintf(stdout, "L%dE:\n", number);
+    fprintf(out, "L%dT:\n", number);
+    codegenBranch(loop->val.children, 1, start, 0);
+    fprintf(out, "L%dE:\n", number);
+    loopDepth--;
 }
 
 static void codegenIf(struct ASTLinkedNode *ifExpr)
 {
-    // We always use j instead of br to avoid issues with labels being too far apart
     int number = uniqueNum++;
-    codegenExpr(ifExpr->val.children, 0);
-    fprintf(stdout, "beq r0, ELSE%dSInter\n", number);
-    fprintf(stdout, "br ELSE%dSInterEnd\n", number);
-    fprintf(stdout, "ELSE%dSInter:\nj ELSE%dS\nELSE%dSInterEnd:\n", number, number, number);
+    char elseLabel[32];
+    snprintf(elseLabel, sizeof(elseLabel), "ELSE%dS", number);
+    codegenBranch(ifExpr->val.children, 0, elseLabel, 0);
     codegenSingleCommand(ifExpr->val.children->next);
     if (ifExpr->val.children->next->next) {
-        fprintf(stdout, "j ELSE%dE\n", number);
+        fprintf(out, "br ELSE%dE\n", number);
     }
-    fprintf(stdout, "ELSE%dS:\n", number);
+    fprintf(out, "ELSE%dS:\n", number);
     if (ifExpr->val.children->next->next) {
         codegenSingleCommand(ifExpr->val.children->next->next);
-        fprintf(stdout, "ELSE%dE:\n", number);
+        fprintf(out, "ELSE%dE:\n", number);
+    }
+}
+
+/*
+ * An inlined call's body runs in the caller's frame. The inliner has already made its returns
+ * put the value where it goes, so all they have left to do is get past the body.
+*/
+static void codegenInlinedCall(struct ASTLinkedNode *call)
+{
+    int outerExit = inlineExit;
+    inlineExit = uniqueNum++;
+    for (struct ASTLinkedNode *command = call->val.children; command != NULL; command = command->next) {
+        codegenSingleCommand(command);
+    }
+    fprintf(out, "INL%dE:\n", inlineExit);
+    inlineExit = outerExit;
+}
+
+/*
+ * The body of a function that tail calls itself, which those calls branch back to the top of.
+*/
+static void codegenTailLoop(struct ASTLinkedNode *loop)
+{
+    tailLoop = uniqueNum++;
+    fprintf(out, "L%dS:\n", tailLoop);
+    loopDepth++;
+    codegenSingleCommand(loop->val.children);
+    loopDepth--;
+    tailLoop = -1;
+}
+
+/*
+ * EFFECTS: returns whether ret returns the result of calling the function it is in, from
+ *   inside a TAIL_LOOP
+*/
+static int isTailCall(struct ASTLinkedNode *ret)
+{
+    struct ASTLinkedNode *value = ret->val.children;
+    return tailLoop >= 0 && inlineExit < 0 && value != NULL && value->val.type == FUNC_CALL
+        && value->val.children->val.definition == currentFn;
+}
+
+/*
+ * Starts the function over with call's arguments instead of calling it. Each parameter is
+ * simply assigned its argument when none of the arguments after it read it; otherwise they are
+ * all pushed first and popped into the parameters once they're all worked out.
+*/
+static void codegenTailCall(struct ASTLinkedNode *call)
+{
+    struct ASTLinkedNode *param, *arg, *later;
+    struct ASTLinkedNode *params = currentFn->val.children->next->val.children;
+    int inOrder = 1, pushed = 0;
+    for (param = params, arg = call->val.children->next->val.children; param != NULL;
+            param = param->next, arg = arg->next) {
+        for (later = arg->next; later != NULL; later = later->next) {
+            if (readsVar(later, param)) inOrder = 0;
+        }
+    }
+    for (param = params, arg = call->val.children->next->val.children; param != NULL;
+            param = param->next, arg = arg->next) {
+        if (arg->val.type == IDENT_REF && arg->val.definition == param) continue;
+        if (inOrder) {
+            codegenLocalAssign(param, arg);
+            continue;
+        }
+        codegenExpr(arg, 0);
+        fputs("deca r5\nst r0, (r5)\n", out);
+        entireFrameOffset += 4;
+        pushed |= 1 << param->val.frameIndex;
+    }
+    for (int i = currentFn->val.paramCount - 1; i >= 0; i--) {
+        if (!(pushed & (1 << i))) continue;
+        for (param = params; param->val.frameIndex != i; param = param->next);
+        entireFrameOffset -= 4;
+        if (param->val.reg >= 0) {
+            fprintf(out, "ld (r5), r%d\ninca r5\n", param->val.reg);
+        } else {
+            fprintf(out, "ld (r5), r0\ninca r5\nst r0, %d(r5)\n", frameOffset(param));
+        }
+    }
+    fprintf(out, "br L%dS\n", tailLoop);
+}
+
+/*
+ * EFFECTS: returns whether anything under node refers to var
+*/
+static int mentionsVar(struct ASTLinkedNode *node, struct ASTLinkedNode *var)
+{
+    if (node->val.type == IDENT_REF) return node->val.definition == var;
+    if (node->val.type == NUMBER_LITERAL) return 0;
+    for (struct ASTLinkedNode *child = node->val.children; child != NULL; child = child->next) {
+        if (mentionsVar(child, var)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * EFFECTS: returns whether evaluating expr might read var, which calls and dereferences could
+*/
+static int readsVar(struct ASTLinkedNode *expr, struct ASTLinkedNode *var)
+{
+    if (expr->val.type == IDENT_REF) return expr->val.definition == var;
+    if (expr->val.type == NUMBER_LITERAL) return 0;
+    if (expr->val.type == FUNC_CALL || (expr->val.type == EXPR && expr->val.operationType == DEREF)) return 1;
+    for (struct ASTLinkedNode *child = expr->val.children; child != NULL; child = child->next) {
+        if (readsVar(child, var)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Generates jumping code for a condition: control goes to target if cond is true (sense == 1)
+ * or false (sense == 0), and falls through otherwise. Comparisons branch straight on the
+ * subtraction instead of building a 0 or 1 first, and `and`, `or` and `!` just steer where
+ * each part jumps to. Like codegenExpr, preserves all regs < reg.
+*/
+static void codegenBranch(struct ASTLinkedNode *cond, int sense, const char *target, int reg)
+{
+    struct ASTLinkedNode *left, *right;
+    enum TokenType op;
+    char skip[32];
+    int t;
+
+    if (cond->val.type == NUMBER_LITERAL) {
+        if ((cond->val.val != 0) == sense) fprintf(out, "br %s\n", target);
+        return;
     }
+    if (cond->val.type != EXPR) {
+        t = varRegister(cond);
+        if (t < 0) {
+            codegenExpr(cond, reg);
+            t = reg;
+        }
+        emitBranchTo(sense ? REL_NE0 : REL_EQ0, t, target);
+        return;
+    }
+    op = cond->val.operationType;
+    left = cond->val.children;
+    right = left->next;
+    if (op == NOT) {
+        codegenBranch(left, !sense, target, reg);
+        return;
+    }
+    // a right side with side effects has to run no matter what the left side says
+    if ((op == AND || op == OR) && !right->val.hasSideEffects) {
+        if ((op == AND) == sense) {
+            // the left side alone can only decide the opposite outcome
+            snprintf(skip, sizeof(skip), "CB%d", uniqueNum++);
+            codegenBranch(left, !sense, skip, reg);
+            codegenBranch(right, sense, target, reg);
+            fprintf(out, "%s:\n", skip);
+        } else {
+            codegenBranch(left, sense, target, reg);
+            codegenBranch(right, sense, target, reg);
+        }
+        return;
+    }
+    if (!isComparison(op)) {
+        codegenExpr(cond, reg);
+        emitBranchTo(sense ? REL_NE0 : REL_EQ0, reg, target);
+        return;
+    }
+
+    enum Relation rel;
+    int v;
+    // put a literal operand on the right, where it folds into an add
+    if (left->val.type == NUMBER_LITERAL && right->val.type != NUMBER_LITERAL) {
+        struct ASTLinkedNode *swap = left;
+        left = right;
+        right = swap;
+        op = mirrorComparison(op);
+    }
+    if (right->val.type == NUMBER_LITERAL) {
+        // x - c can be compared against 0, but so can c - x (which is ~x + (c + 1)) with the
+        // comparison mirrored. The difference can wrap though, so < and <= have to take c - x
+        // and > and >= x - c like compareRegs does. == and != go with whichever adds up to less
+        // along with the branch.
+        unsigned c = right->val.val;
+        int temp = reg + 1 < regCeiling ? reg + 1 : 7;
+        enum Relation direct = zeroRelation(op), reversed = zeroRelation(mirrorComparison(op));
+        v = c == 0 ? varRegister(left) : -1;
+        int inPlace = v >= 0;
+        int directCost = (inPlace ? 0 : addConstantCost((int)(0u - c)))
+            + branchCost(sense ? direct : negateRelation(direct));
+        int reversedCost = 1 + addConstantCost((int)(c + 1))
+            + branchCost(sense ? reversed : negateRelation(reversed));
+        if (op == LESS_THAN || op == LESS_THAN_EQUALS) directCost = reversedCost + 1;
+        else if (op != EQUALS && op != NOT_EQUALS) reversedCost = directCost + 1;
+        if (inPlace && directCost <= reversedCost) {
+            // a variable compared against 0 is tested right in its register
+            rel = direct;
+            t = v;
+        } else if (directCost <= reversedCost) {
+            codegenExpr(left, reg);
+            emitAddConstant(reg, (int)(0u - c), temp);
+            rel = direct;
+            t = reg;
+        } else {
+            codegenExpr(left, reg);
+            fprintf(out, "not r%d\n", reg);
+            emitAddConstant(reg, (int)(c + 1), temp);
+            rel = reversed;
+            t = reg;
+        }
+    } else if ((v = varRegister(right)) >= 0) {
+        codegenExpr(left, reg);
+        rel = compareRegs(op, reg, v, &t);
+    } else if ((v = varRegister(left)) >= 0) {
+        codegenExpr(right, reg);
+        rel = compareRegs(mirrorComparison(op), reg, v, &t);
+    } else if (reg + 1 >= regCeiling) {
+        // comparing two computed values takes a second register, which the spill path owns up here
+        codegenExpr(cond, reg);
+        emitBranchTo(sense ? REL_NE0 : REL_EQ0, reg, target);
+        return;
+    } else {
+        codegenExpr(left, reg);
+        codegenExpr(right, reg + 1);
+        rel = compareRegs(op, reg, reg + 1, &t);
+    }
+    emitBranchTo(sense ? rel : negateRelation(rel), t, target);
 }
 
 static void codegenDirectAssign(struct ASTLinkedNode *assignment)
 {
-    codegenExpr(assignment->val.children->next, 0);
-    if (assignment->val.children->val.definition->val.isStatic) {
-        struct ASTLinkedNode *ident = assignment->val.children->val.definition->val.children;
-        char *name = calloc(ident->val.endIndex - ident->val.startIndex + 1, sizeof(char));
-        getInputSubstr(name, ident->val.startIndex, ident->val.endIndex);
-        fprintf(stdout, "ld $%s, r1\nst r0, (r1)\n", name);
-        free(name);
+    struct ASTLinkedNode *var = assignment->val.children->val.definition;
+    struct ASTLinkedNode *value = assignment->val.children->next;
+    if (!var->val.isStatic) {
+        codegenLocalAssign(var, value);
+        return;
+    }
+    int reg = varRegister(value);
+    if (reg < 0) {
+        codegenExpr(value, 0);
+        reg = 0;
+    }
+    fprintf(out, "ld $%s, r7\nst r%d, (r7)\n", symbolName(assignment->val.children->val.symbol), reg);
+}
+
+/*
+ * Puts value in var, a local or parameter, wherever it lives.
+*/
+static void codegenLocalAssign(struct ASTLinkedNode *var, struct ASTLinkedNode *value)
+{
+    if (var->val.reg >= 0) {
+        codegenRegisterAssign(var, value);
+        return;
+    }
+    int reg = varRegister(value);
+    if (reg < 0) {
+        codegenExpr(value, 0);
+        reg = 0;
+    }
+    fprintf(out, "st r%d, %d(r5)\n", reg, frameOffset(var));
+}
+
+/*
+ * Puts value in the register var lives in. Updates of var like i = i + 1 are done in place.
+ * Assumes access to all temporaries, like a command.
+*/
+static void codegenRegisterAssign(struct ASTLinkedNode *var, struct ASTLinkedNode *value)
+{
+    int reg = var->val.reg;
+    if (value->val.type == NUMBER_LITERAL || value->val.type == IDENT_REF) {
+        // loads straight into reg without touching anything else
+        codegenExpr(value, reg);
+        return;
+    }
+    if (value->val.type == EXPR && (value->val.operationType == PLUS || value->val.operationType == MINUS)) {
+        struct ASTLinkedNode *left = value->val.children, *other = NULL;
+        if (left->val.type == IDENT_REF && left->val.definition == var) {
+            other = left->next;
+        } else if (value->val.operationType == PLUS && left->next->val.type == IDENT_REF
+                && left->next->val.definition == var) {
+            other = left;
+        }
+        if (other != NULL && other->val.type == NUMBER_LITERAL) {
+            unsigned c = other->val.val;
+            emitAddConstant(reg, (int)(value->val.operationType == PLUS ? c : 0u - c), 0);
+            return;
+        }
+        if (other != NULL) {
+            int otherReg = varRegister(other);
+            if (otherReg < 0) {
+                codegenExpr(other, 0);
+                otherReg = 0;
+            }
+            applyInfixOperation(value->val.operationType, reg, otherReg);
+            return;
+        }
+    }
+    codegenExpr(value, 0);
+    fprintf(out, "mov r0, r%d\n", reg);
+}
+
+/*
+ * Generates *address = value. A small constant offset on the address folds into the st.
+*/
+static void codegenIndirectAssign(struct ASTLinkedNode *assignment)
+{
+    int offset;
+    struct ASTLinkedNode *base = splitOffset(assignment->val.children, &offset);
+    struct ASTLinkedNode *value = assignment->val.children->next;
+    int baseReg = varRegister(base), valueReg = varRegister(value);
+    if (baseReg < 0) {
+        codegenExpr(base, 0);
+        baseReg = 0;
+    }
+    if (valueReg < 0) {
+        valueReg = baseReg == 0 ? 1 : 0;
+        codegenExpr(value, valueReg);
+    }
+    if (offset) fprintf(out, "st r%d, %d(r%d)\n", valueReg, offset, baseReg);
+    else fprintf(out, "st r%d, (r%d)\n", valueReg, baseReg);
+}
+
+/*
+ * Loads the word at address into destReg, folding a small constant offset into the ld.
+*/
+static void codegenDeref(struct ASTLinkedNode *address, int destReg)
+{
+    int offset;
+    struct ASTLinkedNode *base = splitOffset(address, &offset);
+    int baseReg = varRegister(base);
+    if (baseReg < 0) {
+        codegenExpr(base, destReg);
+        baseReg = destReg;
+    }
+    if (offset) fprintf(out, "ld %d(r%d), r%d\n", offset, baseReg, destReg);
+    else fprintf(out, "ld (r%d), r%d\n", baseReg, destReg);
+}
+
+/*
+ * EFFECTS: splits address into base + offset when it adds a literal a ld / st can encode, and
+ *   returns the base. Otherwise the offset is 0 and address is the base.
+*/
+static struct ASTLinkedNode *splitOffset(struct ASTLinkedNode *address, int *offset)
+{
+    *offset = 0;
+    if (address->val.type != EXPR || address->val.operationType != PLUS) return address;
+    struct ASTLinkedNode *left = address->val.children;
+    if (isOffsetLiteral(left->next)) {
+        *offset = left->next->val.val;
+        return left;
+    }
+    if (isOffsetLiteral(left)) {
+        *offset = left->val.val;
+        return left->next;
+    }
+    return address;
+}
+
+/*
+ * EFFECTS: returns how many instructions emitAddConstant takes to add constant
+*/
+static int addConstantCost(int constant)
+{
+    if (constant == 0) return 0;
+    if (constant == 1 || constant == -1 || constant == 4 || constant == -4) return 1;
+    return 2;
+}
+
+/*
+ * Adds constant to reg, with tempReg to hold it if there's no single instruction for it.
+*/
+static void emitAddConstant(int reg, int constant, int tempReg)
+{
+    switch (constant) {
+    case 0:
+        return;
+    case 1:
+        fprintf(out, "inc r%d\n", reg);
+        return;
+    case -1:
+        fprintf(out, "dec r%d\n", reg);
+        return;
+    case 4:
+        fprintf(out, "inca r%d\n", reg);
+        return;
+    case -4:
+        fprintf(out, "deca r%d\n", reg);
+        return;
+    default:
+        fprintf(out, "ld $%d, r%d\nadd r%d, r%d\n", constant, tempReg, tempReg, reg);
         return;
     }
-    int offset = assignment->val.children->val.definition->val.frameIndex*4;
-    if (assignment->val.children->val.definition->val.isParam) offset += frameArgOffset;
-    fprintf(stdout, "st r0, %d(r5)\n", offset + entireFrameOffset);
 }
 
 /*
@@ -331,7 +1023,7 @@ static void codegenDirectAssign(struct ASTLinkedNode *assignment)
 static void codegenExpr(struct ASTLinkedNode *expr, int regDest)
 {
     if (expr->val.type == NUMBER_LITERAL) {
-        fprintf(stdout, "ld $%d, r%d\n", expr->val.val, regDest);
+        fprintf(out, "ld $%d, r%d\n", expr->val.val, regDest);
         return;
     } else if (expr->val.type == FUNC_CALL) {
         codegenFuncCall(expr, regDest);
@@ -353,22 +1045,23 @@ static void codegenExpr(struct ASTLinkedNode *expr, int regDest)
 */
 static void codegenPrefixOperation(struct ASTLinkedNode *expr, int destReg)
 {
+    if (expr->val.operationType == DEREF) {
+        codegenDeref(expr->val.children, destReg);
+        return;
+    }
     codegenExpr(expr->val.children, destReg);
     switch (expr->val.operationType) {
-    case MINUS:
-        fprintf(stdout, "not r%d\ninc r%d\n", destReg, destReg);
+    case NEGATE:
+        fprintf(out, "not r%d\ninc r%d\n", destReg, destReg);
         return;
     case BITWISE_NOT:
-        fprintf(stdout, "not r%d\n", destReg);
+        fprintf(out, "not r%d\n", destReg);
         return;
     case NOT:
-        fprintf(stdout, "beq r%d, C%dS\nld $0, r%d\nbr C%dE\nC%dS: ld $1, r%d\nC%dE:\n",
+        fprintf(out, "beq r%d, C%dS\nld $0, r%d\nbr C%dE\nC%dS: ld $1, r%d\nC%dE:\n",
             destReg, uniqueNum, destReg, uniqueNum, uniqueNum, destReg, uniqueNum);
         uniqueNum++;
         return;
-    case DEREF:
-        fprintf(stdout, "ld (r%d), r%d\n", destReg, destReg);
-        return;
     default:
         fprintf(stderr, "CODEGEN: idk how to fold in prefix %s\n", TokenStrings[expr->val.type]);
 		return;
@@ -384,85 +1077,170 @@ static void codegenInfixOperation(struct ASTLinkedNode *expr, int destReg)
     // TODO: handle operation w/ one of left, right an integer literal in different function
 
 	// These we do now because of how horrible the dynamic versions are
+	// (a constant operand has been folded to a literal by analysis)
 	if (expr->val.children->next->val.isConstant) {
+		unsigned amount = expr->val.children->next->val.val;
 		if (expr->val.operationType == LEFT_SHIFT) {
 			codegenExpr(expr->val.children, destReg);
-			fprintf(stdout, "shl $%d, r%d\n", expr->val.children->next->val.val, destReg);
+			if (amount >= 32) fprintf(out, "ld $0, r%d\n", destReg);
+			else fprintf(out, "shl $%u, r%d\n", amount, destReg);
 			return;
 		} else if (expr->val.operationType == RIGHT_SHIFT) {
 			codegenExpr(expr->val.children, destReg);
-			fprintf(stdout, "shr $%d, r%d\n", expr->val.children->next->val.val, destReg);
+			fprintf(out, "shr $%u, r%d\n", amount >= 32 ? 31 : amount, destReg);
 			return;
 		}
 	}
 
-	codegenExpr(expr->val.children, destReg);
-    int right = destReg + 1;
-    if (destReg >= 4) {
-        fprintf(stdout, "deca r5\nst r%d (r5)\n", destReg);
-        entireFrameOffset += 4;
-        codegenExpr(expr->val.children->next, destReg);
-        fprintf(stdout, "mov r%d, r7\n", destReg);
-        fprintf(stdout, "ld (r5), r%d\ninca r5\n", destReg);
-        entireFrameOffset -= 4;
-        right = 7;
-    } else {
-		codegenExpr(expr->val.children->next, right);
+	// multiplying by a known amount never needs the loop
+	if (expr->val.operationType == TIMES) {
+		struct ASTLinkedNode *left = expr->val.children, *right = left->next;
+		if (right->val.isConstant || left->val.isConstant) {
+			if (left->val.isConstant) {
+				right = left;
+				left = left->next;
+			}
+			codegenExpr(left, destReg);
+			codegenConstMultiplication(destReg, right->val.val, destReg + 1 < regCeiling ? destReg + 1 : 7);
+			return;
+		}
 	}
-    switch (expr->val.operationType) {
-	case PLUS:	
-        fprintf(stdout, "add r%d, r%d\n", right, destReg);
+
+	if ((expr->val.operationType == PLUS || expr->val.operationType == MINUS)
+			&& expr->val.children->next->val.type == NUMBER_LITERAL) {
+		unsigned c = expr->val.children->next->val.val;
+		codegenExpr(expr->val.children, destReg);
+		emitAddConstant(destReg, (int)(expr->val.operationType == PLUS ? c : 0u - c),
+			destReg + 1 < regCeiling ? destReg + 1 : 7);
 		return;
-	case MINUS:
-		codegenMinus(destReg, right);
+	}
+
+	if ((expr->val.operationType == DIVIDE || expr->val.operationType == MODULO)
+			&& expr->val.children->next->val.isConstant) {
+		codegenExpr(expr->val.children, destReg);
+		codegenConstDivision(destReg, expr->val.children->next->val.val, expr->val.operationType == MODULO);
+		return;
+	}
+
+	if ((expr->val.operationType == AND || expr->val.operationType == OR)
+			&& !expr->val.children->next->val.hasSideEffects) {
+		codegenLogicalValue(expr, destReg);
+		return;
+	}
+
+	enum TokenType op = expr->val.operationType;
+	int right;
+	// an operand sitting in a variable's register is used right where it is
+	if (isOperandPreserving(op) && (right = varRegister(expr->val.children->next)) >= 0) {
+		codegenExpr(expr->val.children, destReg);
+		applyInfixOperation(op, destReg, right);
+		return;
+	}
+	if (isOperandPreserving(op) && (right = varRegister(expr->val.children)) >= 0) {
+		codegenExpr(expr->val.children->next, destReg);
+		applyReversedOperation(op, destReg, right);
+		return;
+	}
+
+	// Sethi-Ullman: the side that needs more registers goes first, so the other fits in what's
+	// left over instead of spilling. Only if neither side's effects could tell the difference.
+	struct ASTLinkedNode *left = expr->val.children, *second = left->next;
+	int swapped = 0;
+	if (evaluatesRightFirst(expr) && (isReversible(op) || destReg + 1 < regCeiling)) {
+		second = left;
+		left = left->next;
+		swapped = 1;
+	}
+	codegenExpr(left, destReg);
+	right = destReg + 1;
+	if (destReg + 1 < regCeiling) {
+		codegenExpr(second, right);
+	} else if (isLeaf(second)) {
+		// a leaf goes straight into the scratch register
+		right = 7;
+		codegenExpr(second, right);
+	} else {
+		fprintf(out, "deca r5\nst r%d, (r5)\n", destReg);
+		entireFrameOffset += 4;
+		codegenExpr(second, destReg);
+		fprintf(out, "mov r%d, r7\n", destReg);
+		fprintf(out, "ld (r5), r%d\ninca r5\n", destReg);
+		entireFrameOffset -= 4;
+		right = 7;
+	}
+	if (!swapped) {
+		applyInfixOperation(op, destReg, right);
+	} else if (isReversible(op)) {
+		applyReversedOperation(op, destReg, right);
+	} else {
+		// the left operand is the one in right, so compute there and move it back
+		applyInfixOperation(op, right, destReg);
+		fprintf(out, "mov r%d, r%d\n", right, destReg);
+	}
+}
+
+/*
+ * EFFECTS: returns whether applyReversedOperation can do op with its operands swapped
+*/
+static int isReversible(enum TokenType op)
+{
+    switch (op) {
+    case PLUS:
+    case MINUS:
+    case TIMES:
+    case BITWISE_AND:
+    case BITWISE_OR:
+    case BITWISE_XOR:
+        return 1;
+    default:
+        return isComparison(op);
+    }
+}
+
+/*
+ * EFFECTS: returns whether expr is a number or variable, which load in one go into any register
+*/
+static int isLeaf(struct ASTLinkedNode *expr)
+{
+    return expr->val.type == NUMBER_LITERAL
+        || (expr->val.type == IDENT_REF && expr->val.definition->val.type == VAR_DECL);
+}
+
+/*
+ * Computes left `op` right and stores it in left. Operations isOperandPreserving says so about
+ * leave right alone, the rest CLOBBER *BOTH* left and right.
+*/
+static void applyInfixOperation(enum TokenType op, int destReg, int right)
+{
+    switch (op) {
+	case PLUS:	
+        fprintf(out, "add r%d, r%d\n", right, destReg);
+		return;
+	case MINUS:
+		codegenMinus(destReg, right);
 		return;
 	case TIMES:
-        codegenDynamicMultiplication(destReg, right);
+        codegenLongOperation(RT_MUL, destReg, right);
 		return;
 	case DIVIDE:
-        codegenDivide(destReg, right);
+        codegenLongOperation(RT_DIV, destReg, right);
 		return;
 	case MODULO:
-        codegenModulus(destReg, right);
+        codegenLongOperation(RT_MOD, destReg, right);
 		return;
 	case LEFT_SHIFT:
-		codegenLeftShift(destReg, right);
+        codegenLongOperation(RT_SHL, destReg, right);
 		return;
 	case RIGHT_SHIFT:
-		codegenRightShift(destReg, right);
+        codegenLongOperation(RT_SHR, destReg, right);
 		return;
 	case LESS_THAN:
-        codegenMinus(destReg, right);
-        fprintf(stdout, "bgt r%d, C%dS\nld $0, r%d\nbr C%dE\nC%dS: ld $1, r%d\nC%dE:\n",
-            right, uniqueNum, destReg, uniqueNum, uniqueNum, destReg, uniqueNum);
-        uniqueNum++;
-        return;
 	case LESS_THAN_EQUALS:
-        codegenMinus(destReg, right);
-        fprintf(stdout, "bgt r%d, C%dS\nbe r%d, C%dS\nld $0, r%d\nbr C%dE\nC%dS: ld $1, r%d\nC%dE:\n",
-            right, uniqueNum, right, uniqueNum, destReg, uniqueNum, uniqueNum, destReg, uniqueNum);
-        uniqueNum++;
-        return;
 	case GREATER_THAN:
-        codegenMinus(destReg, right);
-        fprintf(stdout, "bgt r%d, C%dS\nld $0, r%d\nbr C%dE\nC%dS: ld $1, r%d\nC%dE:\n",
-            destReg, uniqueNum, destReg, uniqueNum, uniqueNum, destReg, uniqueNum);
-        uniqueNum++;
-        return;
 	case GREATER_THAN_EQUALS:
-        codegenMinus(destReg, right);
-        fprintf(stdout, "bgt r%d, C%dS\nbe r%d, C%dS\nld $0, r%d\nbr C%dE\nC%dS: ld $1, r%d\nC%dE:\n",
-            destReg, uniqueNum, destReg, uniqueNum, destReg, uniqueNum, uniqueNum, destReg, uniqueNum);
-        uniqueNum++;
-        return;
 	case EQUALS:
-        codegenMinus(destReg, right);
-		fprintf(stdout, "beq r%d, C%dS\nld $0, r%d\nbr C%dE\nC%dS: ld $1, r%d\nC%dE:\n",
-            destReg, uniqueNum, destReg, uniqueNum, uniqueNum, destReg, uniqueNum);
-        uniqueNum++;
-		return;
 	case NOT_EQUALS:
-        codegenNotEquals(destReg, right);
+        codegenComparison(op, destReg, right);
 		return;
 	case OR:
         codegenOr(destReg, right);
@@ -471,17 +1249,17 @@ static void codegenInfixOperation(struct ASTLinkedNode *expr, int destReg)
         codegenAnd(destReg, right);
 		return;
 	case BITWISE_AND:
-		fprintf(stdout, "and r%d, r%d\n", right, destReg);
+		fprintf(out, "and r%d, r%d\n", right, destReg);
 		return;
 	case BITWISE_OR:
-        fprintf(stdout, "not r%d\nnot r%d\nand r%d, r%d\nnot r%d\n",
+        fprintf(out, "not r%d\nnot r%d\nand r%d, r%d\nnot r%d\n",
 			destReg, right, right, destReg, destReg);
 		return;
 	case BITWISE_XOR:
 		// a + b = a (+) b + carry = a (+) b + (a ^ b) << 1
 		// ==> a (+) b = a + b - (a ^ b) << 1
-		fputs("deca r5\nst r6 (r5)\n", stdout);
-		fprintf(stdout, 
+		fputs("deca r5\nst r6, (r5)\n", out);
+		fprintf(out, 
 			"mov r%d, r6\n"
 			"and r%d, r6\n"
 			"shl $1, r6\n"
@@ -490,363 +1268,874 @@ static void codegenInfixOperation(struct ASTLinkedNode *expr, int destReg)
 			"add r%d, r%d\n"
 			"add r6, r%d\n",
 			right, destReg, right, destReg, destReg);
-		fputs("ld (r5) r6\ninca r5\n", stdout);
+		fputs("ld (r5), r6\ninca r5\n", out);
 		return;
 	default:
-		fprintf(stderr, "CODEGEN: idk how to fold in %s\n", TokenStrings[expr->val.type]);
+		fprintf(stderr, "CODEGEN: idk how to fold in %s\n", TokenStrings[op]);
 		return;
 	}
 }
 
+/*
+ * REQUIRES: isOperandPreserving(op) or isReversible(op)
+ * EFFECTS: computes left `op` right like applyInfixOperation, but with the operands the other
+ *   way around: right holds the left operand and left the right one.
+*/
+static void applyReversedOperation(enum TokenType op, int left, int right)
+{
+    if (op == MINUS) {
+        // right - left is -left + right
+        fprintf(out, "not r%d\ninc r%d\nadd r%d, r%d\n", left, left, right, left);
+    } else if (isComparison(op)) {
+        codegenComparison(mirrorComparison(op), left, right);
+    } else {
+        applyInfixOperation(op, left, right);
+    }
+}
+
+/*
+ * Computes left - right as ~(~left + right) and stores it in left, leaving right alone.
+*/
 static void codegenMinus(int left, int right)
 {
-    fprintf(stdout, 
+    fprintf(out, 
+        "not r%d\n"
+        "add r%d, r%d\n"
+        "not r%d\n",
+        left, right, left, left);
+}
+
+/*
+ * Computes left / right (or left % right if wantRemainder) for runtime values, rounding towards
+ * zero with the remainder taking the sign of the dividend, and stores it in left.
+ * CLOBBERS *BOTH* left and right.
+ *
+ * Works on n = |left| (as ~left for negatives, so INT_MIN fits) and m = |right| with plain
+ * shift-and-subtract long division: m is doubled while it fits in n, then subtracted back out
+ * one bit at a time. The 1 lost making n is added back onto the remainder at the end.
+ * A divisor of INT_MIN (or 0, which gives nonsense rather than hanging) is handled separately.
+*/
+static void codegenDynamicDivision(int left, int right, int wantRemainder)
+{
+    int tmp[2], saved, number = uniqueNum++;
+    saved = acquireScratch(left, right, 2, tmp);
+    int q = tmp[0], bit = tmp[1];
+
+    fprintf(out,
+        "mov r%d, r%d\n"
+        "add r%d, r%d\n"
+        "beq r%d, DD%d_S\n"
+        "mov r%d, r%d\n"
+        "shr $31, r%d\n"
+        "deca r5\n"
+        "st r%d, (r5)\t\t# save divisor sign\n"
+        "beq r%d, DD%d_A\n"
         "not r%d\n"
         "inc r%d\n"
-        "add r%d, r%d\n",
-        right, right, right, left);
-}
-
-static void codegenDivide(int left, int right)
-{
-	/*
-	 * We need 3 helper regs - division is hard enough when you can decide the hardware!
-	 * This is a modified non-restorative division algorithm given we only have 32 bit regs
-	 * and want integer division.
-	 */
-
-	int count, negativeDivisor, result;
-	count = 6;
-	if (right != 7) {
-		negativeDivisor = 7;
-		if (left != 4 && right != 4) {
-			result = 4;
-		} else if (left != 3 && right != 3) {
-			result = 3;
-		} else {
-			result = 2;
-		}
-	} else if (left != 4) {
-		negativeDivisor = 4;
-		if (left != 3) {
-			result = 3;
-		} else {
-			result = 2;
-		}
-	} else {
-		negativeDivisor = 3;
-		result = 2;
-	}
-	fprintf(stdout,
-		"deca r5\n"
-		"st r%d, (r5)\n"
-		"deca r5\n"
-		"st r%d, (r5)\n"
-		"deca r5\n"
-		"st r%d, (r5)\n",
-		count, negativeDivisor, result);
-	// first, we shift the divisor so everything lines up
-	fprintf(stdout,
-		"ld $1, r%d\n"
-		"ld $0, r%d\n"
-		"L%d_1S:\n"
-		"mov r%d, r%d\n"
-		"not r%d\n"
-		"inc r%d\n"
-		"add r%d, r%d\n"
-		"bgt r%d, L%d_1E\n"
-		"inc r%d\n"
-		"shl $1, r%d\n"
-		"br L%d_1S\n"
-		"L%d_1E:\n",
-		count, result, uniqueNum, left, negativeDivisor, negativeDivisor, negativeDivisor, right, negativeDivisor,
-		negativeDivisor, uniqueNum, count, right, uniqueNum, uniqueNum);
-	// now, we do the division
-	fprintf(stdout,
-		"mov r%d, r%d\n"
-		"not r%d\n"
-		"inc r%d\n"
-		"L%d_2S:\n"
-		"beq r%d, L%d_2E\n"
-		"dec r%d\n"
-		"shl $1, r%d\n"
-		"bgt r%d, L%d_2C\n"
-		"beq r%d, L%d_2C\n"
-		"add r%d, r%d\n"
-		"dec r%d\n"
-		"br L%d_2CE\n"
-		"L%d_2C:\n"
-		"add r%d, r%d\n"
-		"inc r%d\n"
-		"L%d_2CE:\n"
-		"shl $1, r%d\n"
-		"br L%d_2S\n"
-		"L%d_2E:\n",
-		right, negativeDivisor, negativeDivisor, negativeDivisor, uniqueNum, count, uniqueNum, count, result,
-        left, uniqueNum, left, uniqueNum, right, left, result, uniqueNum, uniqueNum, negativeDivisor, left,
-        result, uniqueNum, left, uniqueNum, uniqueNum);
-    // finally, we adjust the result. non-res can choose a negative remainder for integer division - we fix that here
-    fprintf(stdout,
-        "bgt r%d, C%d\n"
-        "beq r%d, C%d\n"
-        "dec r%d\n"
-        "C%d:\n"
-        "mov r%d, r%d\n",
-        left, uniqueNum, left, uniqueNum, result, uniqueNum, result, left);
-	fprintf(stdout,
-		"ld (r5), r%d\n"
-		"inca r5\n"
-		"ld (r5), r%d\n"
-		"inca r5\n"
-		"ld (r5), r%d\n"
-		"inca r5\n",
-		result, negativeDivisor, count);
-    uniqueNum++;
+        "DD%d_A:\n"
+        "mov r%d, r%d\n"
+        "shr $31, r%d\n"
+        "deca r5\n"
+        "st r%d, (r5)\t\t# save dividend sign\n"
+        "beq r%d, DD%d_B\n"
+        "not r%d\n"
+        "DD%d_B:\n"
+        "deca r5\n"
+        "st r%d, (r5)\t\t# save |divisor|\n",
+        right, q, q, q, q, number, right, bit, bit, bit, bit, number, right, right, number,
+        left, bit, bit, bit, bit, number, left, number, right);
+    // double m (and bit) while 2m <= n, tracking h - m where h = n >> 1
+    fprintf(out,
+        "mov r%d, r%d\n"
+        "shr $1, r%d\n"
+        "not r%d\n"
+        "add r%d, r%d\n"
+        "not r%d\n"
+        "ld $1, r%d\n"
+        "DD%d_1S:\n"
+        "bgt r%d, DD%d_1C\n"
+        "beq r%d, DD%d_1C\n"
+        "br DD%d_1E\n"
+        "DD%d_1C:\n"
+        "not r%d\n"
+        "add r%d, r%d\n"
+        "not r%d\n"
+        "shl $1, r%d\n"
+        "shl $1, r%d\n"
+        "br DD%d_1S\n"
+        "DD%d_1E:\n",
+        left, q, q, q, right, q, q, bit, number, q, number, q, number, number, number,
+        q, right, q, q, right, bit, number, number);
+    // subtract it back out
+    fprintf(out,
+        "ld $0, r%d\n"
+        "DD%d_2S:\n"
+        "not r%d\n"
+        "add r%d, r%d\n"
+        "not r%d\n"
+        "bgt r%d, DD%d_2T\n"
+        "beq r%d, DD%d_2T\n"
+        "add r%d, r%d\n"
+        "br DD%d_2N\n"
+        "DD%d_2T:\n"
+        "add r%d, r%d\n"
+        "DD%d_2N:\n"
+        "shr $1, r%d\n"
+        "shr $1, r%d\n"
+        "beq r%d, DD%d_2E\n"
+        "br DD%d_2S\n"
+        "DD%d_2E:\n",
+        q, number, left, right, left, left, left, number, left, number, right, left, number,
+        number, bit, q, number, right, bit, bit, number, number, number);
+    // r += 1 for negative dividends, which can make r == m
+    fprintf(out,
+        "ld (r5), r%d\n"
+        "inca r5\n"
+        "ld (r5), r%d\n"
+        "inca r5\n"
+        "beq r%d, DD%d_3E\n"
+        "inc r%d\n"
+        "not r%d\n"
+        "add r%d, r%d\n"
+        "not r%d\n"
+        "beq r%d, DD%d_3Z\n"
+        "add r%d, r%d\n"
+        "br DD%d_3E\n"
+        "DD%d_3Z:\n"
+        "inc r%d\n"
+        "DD%d_3E:\n",
+        right, bit, bit, number, left, left, right, left, left, left, number, right, left, number,
+        number, q, number);
+    if (wantRemainder) {
+        fprintf(out, "beq r%d, DD%d_R\nnot r%d\ninc r%d\nDD%d_R:\ninca r5\nbr DD%d_E\n",
+            bit, number, left, left, number, number);
+    } else {
+        fprintf(out,
+            "beq r%d, DD%d_Q1\n"
+            "not r%d\n"
+            "inc r%d\n"
+            "DD%d_Q1:\n"
+            "ld (r5), r%d\n"
+            "inca r5\n"
+            "beq r%d, DD%d_Q2\n"
+            "not r%d\n"
+            "inc r%d\n"
+            "DD%d_Q2:\n"
+            "mov r%d, r%d\n"
+            "br DD%d_E\n",
+            bit, number, q, q, number, bit, bit, number, q, q, number, q, left, number);
+    }
+    // right is 0 or INT_MIN: only INT_MIN divides by INT_MIN
+    fprintf(out, "DD%d_S:\nmov r%d, r%d\nadd r%d, r%d\nbeq r%d, DD%d_SM\n", number, left, q, right, q, q, number);
+    if (wantRemainder) {
+        fprintf(out, "br DD%d_E\nDD%d_SM:\nld $0, r%d\n", number, number, left);
+    } else {
+        fprintf(out, "ld $0, r%d\nbr DD%d_E\nDD%d_SM:\nld $1, r%d\n", left, number, number, left);
+    }
+    fprintf(out, "DD%d_E:\n", number);
+    releaseScratch(tmp, 2, saved);
+}
+
+/*
+ * Shifts left by right for a runtime amount, storing the result in left. Amounts outside 0..31
+ * shift everything out (right shifts are arithmetic, so they leave the sign), matching folding.
+ * Otherwise each of the 5 bits of the amount is moved up to the sign bit and tested in turn.
+ * CLOBBERS *BOTH* left and right.
+*/
+static void codegenDynamicShift(int left, int right, int isLeft)
+{
+    const char *op = isLeft ? "shl" : "shr";
+    int tmp[1], saved, number = uniqueNum++;
+    saved = acquireScratch(left, right, 1, tmp);
+
+    fprintf(out, "mov r%d, r%d\nshr $5, r%d\nbeq r%d, SH%d_S\n", right, tmp[0], tmp[0], tmp[0], number);
+    if (isLeft) fprintf(out, "ld $0, r%d\n", left);
+    else fprintf(out, "shr $31, r%d\n", left);
+    fprintf(out, "br SH%d_E\nSH%d_S:\nshl $27, r%d\n", number, number, right);
+    for (int b = 4; b >= 0; b--) {
+        fprintf(out, "bgt r%d, SH%d_%d\nbeq r%d, SH%d_%d\n%s $%d, r%d\nSH%d_%d:\n",
+            right, number, b, right, number, b, op, 1 << b, left, number, b);
+        if (b > 0) fprintf(out, "shl $1, r%d\n", right);
+    }
+    fprintf(out, "SH%d_E:\n", number);
+    releaseScratch(tmp, 1, saved);
 }
 
+/*
+ * Emits left `op` right for one of the long dynamic operations, either inline or as a call to
+ * the shared runtime copy, depending on what we are optimizing for.
+ * CLOBBERS *BOTH* left and right.
+*/
+static void codegenLongOperation(enum RuntimeRoutine routine, int left, int right)
+{
+    if (useRuntimeRoutine(routine)) {
+        codegenRuntimeCall(routine, left, right);
+        return;
+    }
+    emitLongOperation(routine, left, right);
+}
 
-static void codegenModulus(int left, int right)
+static void emitLongOperation(enum RuntimeRoutine routine, int left, int right)
 {
-    /*
-     * Modified from codegenDiv 
-    */
-   int count, negativeDivisor;
-	count = 6;
-	if (right != 7) {
-		negativeDivisor = 7;
-	} else if (left != 4) {
-		negativeDivisor = 4;
-	} else {
-		negativeDivisor = 3;
-	}
-	fprintf(stdout,
-		"deca r5\n"
-		"st r%d, (r5)\n"
-		"deca r5\n"
-		"st r%d, (r5)\n",
-		count, negativeDivisor);
-	// first, we shift the divisor so everything lines up
-	fprintf(stdout,
-		"ld $0, r%d\n"
-		"L%d_1S:\n"
-		"mov r%d, r%d\n"
-		"not r%d\n"
-		"inc r%d\n"
-		"add r%d, r%d\n"
-		"bgt r%d, L%d_1E\n"
-		"inc r%d\n"
-		"shl $1, r%d\n"
-		"br L%d_1S\n"
-		"L%d_1E:\n",
-		count, uniqueNum, left, negativeDivisor, negativeDivisor, negativeDivisor, right, negativeDivisor,
-		negativeDivisor, uniqueNum, count, right, uniqueNum, uniqueNum);
-	// now, we do the division
-	fprintf(stdout,
-		"mov r%d, r%d\n"
-		"not r%d\n"
-		"inc r%d\n"
-		"L%d_2S:\n"
-		"beq r%d, L%d_2E\n"
-		"dec r%d\n"
-		"bgt r%d, L%d_2C\n"
-		"beq r%d, L%d_2C\n"
-		"add r%d, r%d\n"
-		"br L%d_2CE\n"
-		"L%d_2C:\n"
-		"add r%d, r%d\n"
-		"L%d_2CE:\n"
-		"shr $1, r%d\n"
-        "shr $1, r%d\n"
-		"br L%d_2S\n"
-		"L%d_2E:\n",
-		right, negativeDivisor, negativeDivisor, negativeDivisor, uniqueNum, count, uniqueNum, count,
-        left, uniqueNum, left, uniqueNum, right, left, uniqueNum, uniqueNum, negativeDivisor, left,
-        uniqueNum, right, negativeDivisor, uniqueNum, uniqueNum);
-    // finally, we adjust the result. non-res can choose a negative remainder for integer division - we fix that here
-    fprintf(stdout,
-        "bgt r%d, C%d\n"
-        "beq r%d, C%d\n"
-        "add r1, r0\n"
-        "C%d:\n",
-        left, uniqueNum, left, uniqueNum, uniqueNum);
-	fprintf(stdout,
-		"ld (r5), r%d\n"
-		"inca r5\n"
-		"ld (r5), r%d\n"
-		"inca r5\n",
-		negativeDivisor, count);
-    uniqueNum++;
+    switch (routine) {
+    case RT_MUL:
+        codegenDynamicMultiplication(left, right);
+        return;
+    case RT_DIV:
+        codegenDynamicDivision(left, right, 0);
+        return;
+    case RT_MOD:
+        codegenDynamicDivision(left, right, 1);
+        return;
+    case RT_SHL:
+        codegenDynamicShift(left, right, 1);
+        return;
+    case RT_SHR:
+        codegenDynamicShift(left, right, 0);
+        return;
+    default:
+        return;
+    }
 }
 
 /*
- * I am of the opinion that allowing a register input for shl would
- * be worth it. This is hell.
-*/
-static void codegenLeftShift(int left, int right)
-{
-	fputs("deca r5\nst r6 (r5)\n", stdout);
-	fprintf(stdout,
-		"ld $-31, r6\n"
-		"add r%d, r6\n"
-		"bgt bigshl%d\n"
-		"br smallshl%d\n"
-		"bigshl%d:\n"
-		"ld $0, r%d\n"
-		"br LSH%d32\n"
-		"smallshl%d:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, LSH%d2\n"
-		"shl $1, r%d\n"
-		"LSH%d2:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, LSH%d4\n"
-		"shl $2, r%d\n"
-		"LSH%d4:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, LSH%d8\n"
-		"shl $4, r%d\n"
-		"LSH%d8:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, LSH%d16\n"
-		"shl $8, r%d\n"
-		"LSH%d16:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, LSH%d16\n"
-		"shl $16, r%d\n"
-		"LSH%d32:\n",
-		right, uniqueNum, uniqueNum, uniqueNum, left, uniqueNum, uniqueNum, right, right,
-		uniqueNum, left, uniqueNum, right, right, uniqueNum, left, uniqueNum,
-		right, right, uniqueNum, left, uniqueNum, right, right, uniqueNum, left,
-		uniqueNum, right, right, uniqueNum, left, uniqueNum);
-	uniqueNum++;
-	fputs("ld (r5) r6\ninca r5\n", stdout);
-}
-
-static void codegenRightShift(int left, int right)
-{
-	fputs("deca r5\nst r6 (r5)\n", stdout);
-	fprintf(stdout,
-		"ld $-31, r6\n"
-		"add r%d, r6\n"
-		"bgt bigshr%d\n"
-		"br smallshr%d\n"
-		"bigshr%d:\n"
-		"ld $0, r%d\n"
-		"br LSH%d32\n"
-		"smallshr%d:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, RSH%d2\n"
-		"shr $1, r%d\n"
-		"RSH%d2:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, RSH%d4\n"
-		"shr $2, r%d\n"
-		"RSH%d4:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, RSH%d8\n"
-		"shr $4, r%d\n"
-		"RSH%d8:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, RSH%d16\n"
-		"shr $8, r%d\n"
-		"RSH%d16:\n"
-		"ld $1, r6\n"
-		"and r%d, r6\n"
-		"shr $1, r%d\n"
-		"beq r6, RSH%d16\n"
-		"shr $16, r%d\n"
-		"RSH%d32:\n",
-		right, uniqueNum, uniqueNum, uniqueNum, left, uniqueNum, uniqueNum, right, right,
-		uniqueNum, left, uniqueNum, right, right, uniqueNum, left, uniqueNum,
-		right, right, uniqueNum, left, uniqueNum, right, right, uniqueNum, left,
-		uniqueNum, right, right, uniqueNum, left, uniqueNum);
-	uniqueNum++;
-	fputs("ld (r5) r6\ninca r5\n", stdout);
-}
-
-static void codegenNotEquals(int left, int right)
-{
-    codegenMinus(left, right);
-    fprintf(stdout,
-        "beq r%d, C%dS\n"
-        "ld $1, r%d\n"
-        "br C%dE\n"
-        "C%dS: ld $0, r%d\n"
-        "C%dE:\n",
-        left, uniqueNum, left, uniqueNum, uniqueNum, left, uniqueNum);
-    uniqueNum++;
+ * -O2 keeps operations inside loops inline, where the call overhead would be paid over and over,
+ * and shares the rest. -Os shares anything used more than once - a single use is smaller inline
+ * since there is no call sequence or return.
+*/
+static int useRuntimeRoutine(enum RuntimeRoutine routine)
+{
+    switch (optLevel) {
+    case OPT_SIZE:
+        return runtimeSites[routine] > 1;
+    case OPT_SPEED:
+        return loopDepth == 0 && runtimeSitesOutsideLoops[routine] > 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Calls a runtime routine: left and right go in r0 and r1, the result comes back in r0 and r7
+ * holds the return address. Everything below left is live, so r0 and r1 are saved if needed.
+ * CLOBBERS *BOTH* left and right.
+*/
+static void codegenRuntimeCall(enum RuntimeRoutine routine, int left, int right)
+{
+    if (left > 0) fputs("deca r5\nst r0, (r5)\n", out);
+    if (left > 1) fputs("deca r5\nst r1, (r5)\n", out);
+    if (left == 1 && right == 0) {
+        fputs("mov r0, r7\nmov r1, r0\nmov r7, r1\n", out);
+    } else if (right == 0) {
+        // right is sitting in r0, so it has to move out before left moves in
+        fprintf(out, "mov r0, r1\nmov r%d, r0\n", left);
+    } else {
+        if (left != 0) fprintf(out, "mov r%d, r0\n", left);
+        if (right != 1) fprintf(out, "mov r%d, r1\n", right);
+    }
+    fprintf(out, "gpc $6, r7\nj %s\n", runtimeNames[routine]);
+    if (left != 0) fprintf(out, "mov r0, r%d\n", left);
+    if (left > 1) fputs("ld (r5), r1\ninca r5\n", out);
+    if (left > 0) fputs("ld (r5), r0\ninca r5\n", out);
+    runtimeUsed[routine] = 1;
+}
+
+/*
+ * EFFECTS: emits one copy of every runtime routine that was called. They preserve every register
+ * but r0, r1 and r7.
+*/
+static void codegenRuntimeRoutines()
+{
+    for (int i = 0; i < RT_COUNT; i++) {
+        if (!runtimeUsed[i]) continue;
+        fprintf(out, "%s:\n", runtimeNames[i]);
+        emittingRuntime = 1;
+        emitLongOperation(i, 0, 1);
+        emittingRuntime = 0;
+        fputs("j (r7)\n\n", out);
+    }
+}
+
+/*
+ * EFFECTS: counts the sites that need a long dynamic operation, in and outside of loops.
+*/
+static void countRuntimeSites(struct ASTLinkedNode *node, int inLoop)
+{
+    for (; node != NULL; node = node->next) {
+        if (node->val.type == EXPR && node->val.children && node->val.children->next) {
+            int routine = runtimeRoutineFor(node);
+            if (routine >= 0) {
+                runtimeSites[routine]++;
+                if (!inLoop) runtimeSitesOutsideLoops[routine]++;
+            }
+        }
+        if (node->val.type != NUMBER_LITERAL) {
+            countRuntimeSites(node->val.children, inLoop || node->val.type == WHILE_LOOP
+                || node->val.type == TAIL_LOOP);
+        }
+    }
+}
+
+/*
+ * EFFECTS: returns which runtime routine a binary EXPR needs, or -1 if it has a constant operand
+ *   that lets it be generated directly.
+*/
+static int runtimeRoutineFor(struct ASTLinkedNode *expr)
+{
+    struct ASTLinkedNode *left = expr->val.children, *right = left->next;
+    switch (expr->val.operationType) {
+    case TIMES:
+        return left->val.isConstant || right->val.isConstant ? -1 : RT_MUL;
+    case DIVIDE:
+        return right->val.isConstant ? -1 : RT_DIV;
+    case MODULO:
+        return right->val.isConstant ? -1 : RT_MOD;
+    case LEFT_SHIFT:
+        return right->val.isConstant ? -1 : RT_SHL;
+    case RIGHT_SHIFT:
+        return right->val.isConstant ? -1 : RT_SHR;
+    default:
+        return -1;
+    }
 }
 
+/*
+ * REQUIRES: left and right hold the operands of comparison op. If right == left, left already
+ *   holds left - right (or right - left for < and <=).
+ * EFFECTS: reduces the comparison to a relation between one register and 0 - the register is
+ *   left, holding left - right for == != > >= and right - left for < <=, and is returned
+ *   through testReg.
+ * CLOBBERS left.
+*/
+static enum Relation compareRegs(enum TokenType op, int left, int right, int *testReg)
+{
+    int lessThan = op == LESS_THAN || op == LESS_THAN_EQUALS;
+    *testReg = left;
+    if (right != left) {
+        if (lessThan) applyReversedOperation(MINUS, left, right);
+        else codegenMinus(left, right);
+    }
+    return zeroRelation(lessThan ? mirrorComparison(op) : op);
+}
+
+/*
+ * EFFECTS: returns the relation x `op` 0 tests
+*/
+static enum Relation zeroRelation(enum TokenType op)
+{
+    switch (op) {
+    case EQUALS:
+        return REL_EQ0;
+    case NOT_EQUALS:
+        return REL_NE0;
+    case GREATER_THAN:
+        return REL_GT0;
+    case GREATER_THAN_EQUALS:
+        return REL_GE0;
+    case LESS_THAN:
+        return REL_LT0;
+    default:
+        return REL_LE0;
+    }
+}
+
+/*
+ * EFFECTS: returns the comparison that gives the same answer with its operands swapped
+*/
+static enum TokenType mirrorComparison(enum TokenType op)
+{
+    switch (op) {
+    case LESS_THAN:
+        return GREATER_THAN;
+    case LESS_THAN_EQUALS:
+        return GREATER_THAN_EQUALS;
+    case GREATER_THAN:
+        return LESS_THAN;
+    case GREATER_THAN_EQUALS:
+        return LESS_THAN_EQUALS;
+    default:
+        return op;
+    }
+}
+
+static enum Relation negateRelation(enum Relation rel)
+{
+    // relations are laid out in complementary pairs
+    return rel ^ 1;
+}
+
+/*
+ * EFFECTS: returns how many instructions emitBranchTo takes to branch on rel
+*/
+static int branchCost(enum Relation rel)
+{
+    switch (rel) {
+    case REL_EQ0:
+    case REL_GT0:
+        return 1;
+    case REL_LT0:
+        return 3;
+    default:
+        return 2;
+    }
+}
+
+/*
+ * Jumps to target if reg `rel` 0 holds. Branches are emitted short, relaxBranches widens
+ * any that turn out not to reach.
+*/
+static void emitBranchTo(enum Relation rel, int reg, const char *target)
+{
+    int number;
+    switch (rel) {
+    case REL_EQ0:
+        fprintf(out, "beq r%d, %s\n", reg, target);
+        return;
+    case REL_GT0:
+        fprintf(out, "bgt r%d, %s\n", reg, target);
+        return;
+    case REL_GE0:
+        fprintf(out, "bgt r%d, %s\nbeq r%d, %s\n", reg, target, reg, target);
+        return;
+    default:
+        break;
+    }
+    // the rest only have a branch for the opposite, so hop over the one to target
+    number = uniqueNum++;
+    if (rel == REL_NE0) {
+        fprintf(out, "beq r%d, CB%d\n", reg, number);
+    } else if (rel == REL_LE0) {
+        fprintf(out, "bgt r%d, CB%d\n", reg, number);
+    } else {
+        fprintf(out, "bgt r%d, CB%d\nbeq r%d, CB%d\n", reg, number, reg, number);
+    }
+    fprintf(out, "br %s\nCB%d:\n", target, number);
+}
+
+/*
+ * Computes comparison op between left and right as 0 or 1 and stores it in left.
+ * CLOBBERS *BOTH* left and right.
+*/
+static void codegenComparison(enum TokenType op, int left, int right)
+{
+    int t, number = uniqueNum++;
+    enum Relation rel = compareRegs(op, left, right, &t);
+    // branch to the 1 when rel holds
+    switch (rel) {
+    case REL_EQ0:
+        fprintf(out, "beq r%d, C%dS\n", t, number);
+        break;
+    case REL_NE0:
+        fprintf(out, "beq r%d, C%dE0\nbr C%dS\nC%dE0:\n", t, number, number, number);
+        break;
+    case REL_GT0:
+        fprintf(out, "bgt r%d, C%dS\n", t, number);
+        break;
+    default:
+        fprintf(out, "bgt r%d, C%dS\nbeq r%d, C%dS\n", t, number, t, number);
+        break;
+    }
+    fprintf(out, "ld $0, r%d\nbr C%dE\nC%dS: ld $1, r%d\nC%dE:\n", left, number, number, left, number);
+}
+
+static int isComparison(enum TokenType op)
+{
+    return op == LESS_THAN || op == LESS_THAN_EQUALS || op == GREATER_THAN
+        || op == GREATER_THAN_EQUALS || op == EQUALS || op == NOT_EQUALS;
+}
+
+/*
+ * Computes `and` / `or` expr as 0 or 1 in destReg, short-circuiting: the right side is only
+ * evaluated when the left side doesn't already decide the result.
+ * REQUIRES: evaluating the right side has no side effects, so skipping it can't be noticed.
+*/
+static void codegenLogicalValue(struct ASTLinkedNode *expr, int destReg)
+{
+    int number = uniqueNum++;
+    char falseLabel[32];
+    snprintf(falseLabel, sizeof(falseLabel), "C%dF", number);
+    codegenBranch(expr, 0, falseLabel, destReg);
+    fprintf(out, "ld $1, r%d\nbr C%dE\nC%dF: ld $0, r%d\nC%dE:\n",
+        destReg, number, number, destReg, number);
+}
+
+/*
+ * Computes left or right as 0 or 1 and stores it in left. Both sides have already been
+ * evaluated - this is for when the right side has side effects, so has to run regardless.
+ * CLOBBERS *BOTH* left and right.
+*/
 static void codegenOr(int left, int right)
 {
-    fprintf(stdout,
-        "beq r%d, C%dS\n"
-        "beq r%d, C%dS\n"
-        "ld $0, r%d\n"
-        "br C%dE\n"
-        "C%dS:ld $1, r%d\n"
+    // left being 0 leaves just the right side to decide
+    fprintf(out,
+        "beq r%d, C%dR\n"
+        "br C%dT\n"
+        "C%dR: mov r%d, r%d\n"
+        "beq r%d, C%dE\n"
+        "C%dT: ld $1, r%d\n"
         "C%dE:\n",
-        left, uniqueNum, right, uniqueNum, left, uniqueNum, uniqueNum, left, uniqueNum);
+        left, uniqueNum, uniqueNum, uniqueNum, right, left, left, uniqueNum, uniqueNum, left, uniqueNum);
     uniqueNum++;
 }
 
+/*
+ * Computes left and right as 0 or 1 and stores it in left, see codegenOr.
+ * CLOBBERS *BOTH* left and right.
+*/
 static void codegenAnd(int left, int right)
 {
-    fprintf(stdout,
-        "beq r%d, C%dS\n"
-        "beq r%d, C%dS\n"
+    // a 0 in left is already the answer, otherwise the right side decides
+    fprintf(out,
+        "beq r%d, C%dE\n"
+        "mov r%d, r%d\n"
+        "beq r%d, C%dE\n"
         "ld $1, r%d\n"
-        "br C%dE\n"
-        "C%dS:\n"
-        "ld $0, r%d\n"
         "C%dE:\n",
-        left, uniqueNum, right, uniqueNum, left, uniqueNum, uniqueNum, left, uniqueNum);
+        left, uniqueNum, right, left, left, uniqueNum, left, uniqueNum);
     uniqueNum++;
 }
 
 /*
- * Calculates left * right, stores result in left
+ * Calculates left * right, stores result in left.
+ * CLOBBERS *BOTH* left and right.
+ *
+ * Shift-and-add, driven by whichever operand is smaller in magnitude: since x*y = (-x)*(-y),
+ * signs are sorted out once up front by negating both so the driver ends up non-negative.
+ * The loop then handles 4 bits of the driver per iteration.
+ * A driver of INT_MIN can't be made positive, but x * INT_MIN is just x << 31.
 */
 static void codegenDynamicMultiplication(int left, int right)
 {
-    // we need 2 extra regs for this - we use r6, and either r7 or r4 or r1
-    int tempReg;
-    if (left != 7 && right != 7) {
-        tempReg = 7;
-    } else if (left != 4 && right != 4) {
-        tempReg = 4;
-    } else {
-        tempReg = 1;
+    int tmp[2], saved, number = uniqueNum++;
+    saved = acquireScratch(left, right, 2, tmp);
+    int acc = tmp[0], t = tmp[1];
+
+    // make right non-negative
+    fprintf(out,
+        "bgt r%d, M%d_P\n"
+        "beq r%d, M%d_Z\n"
+        "not r%d\n"
+        "inc r%d\n"
+        "not r%d\n"
+        "inc r%d\n"
+        "bgt r%d, M%d_P\n"
+        "shl $31, r%d\n"
+        "br M%d_D\n"
+        "M%d_P:\n",
+        right, number, right, number, right, right, left, left, right, number, left, number, number);
+    // right drives unless |left| is smaller
+    fprintf(out,
+        "bgt r%d, M%d_LP\n"
+        "beq r%d, M%d_Z\n"
+        "mov r%d, r%d\n"
+        "add r%d, r%d\n"
+        "bgt r%d, M%d_NS\n"
+        "br M%d_L\n"
+        "M%d_LP:\n"
+        "mov r%d, r%d\n"
+        "not r%d\n"
+        "inc r%d\n"
+        "add r%d, r%d\n"
+        "bgt r%d, M%d_L\n"
+        "M%d_S:\n"
+        "mov r%d, r%d\n"
+        "mov r%d, r%d\n"
+        "mov r%d, r%d\n"
+        "br M%d_L\n"
+        "M%d_NS:\n"
+        "not r%d\n"
+        "inc r%d\n"
+        "not r%d\n"
+        "inc r%d\n"
+        "br M%d_S\n"
+        "M%d_Z:\n"
+        "ld $0, r%d\n"
+        "br M%d_D\n",
+        left, number, left, number, left, t, right, t, t, number, number, number,
+        right, t, t, t, left, t, t, number, number, left, t, right, left, t, right, number,
+        number, left, left, right, right, number, number, left, number);
+    fprintf(out, "M%d_L:\nld $0, r%d\nM%d_1:\nbeq r%d, M%d_E\n", number, acc, number, right, number);
+    for (int b = 0; b < 4; b++) {
+        fprintf(out, "mov r%d, r%d\nshl $31, r%d\nbeq r%d, M%d_B%d\nadd r%d, r%d\nM%d_B%d:\nshl $1, r%d\nshr $1, r%d\n",
+            right, t, t, t, number, b, left, acc, number, b, left, right);
     }
+    fprintf(out, "br M%d_1\nM%d_E:\nmov r%d, r%d\nM%d_D:\n", number, number, acc, left, number);
+    releaseScratch(tmp, 2, saved);
+}
 
+/*
+ * A way of writing a multiplier as a sum of signed powers of two: digits[k] is -1, 0 or 1.
+ * cost is how many instructions emitting it takes (they are all 2 bytes and 1 cycle).
+*/
+struct MulRecoding {
+    signed char digits[32];
+    int negateAfter;
+    int cost;
+};
 
-    fprintf(stdout, "deca r5\nst r6, (r5)\ndeca r5\nst r%d, (r5)\n", tempReg);
-    fprintf(stdout, "mov r%d, r%d\n", left, tempReg);
-    fprintf(stdout, "ld $0, r%d\n", left);
-    fprintf(stdout, "L%d:\n", uniqueNum);
-    fprintf(stdout, "beq r%d, L%dE\n", right, uniqueNum);
-    fprintf(stdout, "ld $1, r6\nand r%d, r6\nbeq r6, L%dC\nadd r%d, r%d\n", right, uniqueNum, tempReg, left);
-    fprintf(stdout, "L%dC:\nshr $1, r%d\n shl $1, r%d\n", uniqueNum, right, tempReg);
-    fprintf(stdout, "br L%d\n", uniqueNum);
-    fprintf(stdout, "L%dE:\n", uniqueNum);
-    fprintf(stdout, "ld (r5), r%d\ninca r5\nld (r5), r6\ninca r5\n", tempReg);
-    uniqueNum++;
-}
\ No newline at end of file
+/*
+ * EFFECTS: writes constant into r as plain binary (naf == 0) or in non-adjacent form (naf == 1),
+ *   where runs of ones become a single add and a single subtract. Digits past bit 31 only
+ *   contribute multiples of 2^32, so they are dropped.
+ *   Then prices the sequence codegenConstMultiplication would emit for it.
+*/
+static void recodeMultiplier(unsigned constant, int naf, int negateAfter, struct MulRecoding *r)
+{
+    int k, top = -1, low = -1, nonzero = 0;
+
+    for (k = 0; k < 32; k++) {
+        r->digits[k] = 0;
+        if (constant & 1) {
+            r->digits[k] = (naf && (constant & 3) == 3) ? -1 : 1;
+            constant -= r->digits[k];
+        }
+        constant >>= 1;
+    }
+    r->negateAfter = negateAfter;
+    r->cost = negateAfter ? 2 : 0;
+    for (k = 31; k >= 0; k--) {
+        if (r->digits[k] == 0) continue;
+        if (top < 0) {
+            top = k;
+            if (r->digits[k] < 0) r->cost += 2;         // not, inc
+        } else {
+            r->cost += (low - k > 0) + (r->digits[k] > 0 ? 1 : 3);  // shl, then add or not/add/not
+        }
+        low = k;
+        nonzero++;
+    }
+    if (nonzero > 1) r->cost++;                         // keep a copy of the multiplicand
+    if (low > 0) r->cost++;                             // trailing zeros
+}
+
+/*
+ * Multiplies reg by a compile time constant in place with a straight line of shifts and adds
+ * (24*j = ((j << 1) + j) << 3), never the multiplication loop.
+ * Tries binary and non-adjacent recodings of both constant and -constant (negating the product
+ * afterwards) and emits whichever is cheapest.
+ * CLOBBERS tempReg.
+*/
+static void codegenConstMultiplication(int reg, int constant, int tempReg)
+{
+    struct MulRecoding candidate, best;
+    int k, prev = -1;
+
+    if (constant == 0) {
+        fprintf(out, "ld $0, r%d\n", reg);
+        return;
+    }
+    recodeMultiplier(constant, 0, 0, &best);
+    recodeMultiplier(constant, 1, 0, &candidate);
+    if (candidate.cost < best.cost) best = candidate;
+    recodeMultiplier(0u - (unsigned)constant, 0, 1, &candidate);
+    if (candidate.cost < best.cost) best = candidate;
+    recodeMultiplier(0u - (unsigned)constant, 1, 1, &candidate);
+    if (candidate.cost < best.cost) best = candidate;
+
+    // Horner's rule from the top digit down: acc = (acc << gap) +/- x
+    for (k = 31; k >= 0; k--) {
+        if (best.digits[k] == 0) continue;
+        if (prev < 0) {
+            for (int j = k - 1; j >= 0; j--) {
+                if (best.digits[j] != 0) {
+                    fprintf(out, "mov r%d, r%d\n", reg, tempReg);
+                    break;
+                }
+            }
+            if (best.digits[k] < 0) fprintf(out, "not r%d\ninc r%d\n", reg, reg);
+        } else {
+            if (prev - k > 0) fprintf(out, "shl $%d, r%d\n", prev - k, reg);
+            if (best.digits[k] > 0) {
+                fprintf(out, "add r%d, r%d\n", tempReg, reg);
+            } else {
+                // a - x == ~(~a + x)
+                fprintf(out, "not r%d\nadd r%d, r%d\nnot r%d\n", reg, tempReg, reg, reg);
+            }
+        }
+        prev = k;
+    }
+    if (prev > 0) fprintf(out, "shl $%d, r%d\n", prev, reg);
+    if (best.negateAfter) fprintf(out, "not r%d\ninc r%d\n", reg, reg);
+}
+
+/*
+ * Picks count scratch registers for an operation computing into destReg (and otherReg, if it is
+ * not -1). Regs above destReg (up to r4) and r7 are free for the taking, as codegenExpr allows;
+ * after that r6 and then the live regs below destReg are borrowed and saved on the stack.
+ * Inside a runtime routine everything but the operands has to be borrowed.
+ * Returns how many were saved, which releaseScratch needs to undo it.
+*/
+static int acquireScratch(int destReg, int otherReg, int count, int *regs)
+{
+    static const int borrowOrder[] = {6, 0, 1, 2, 3, 4};
+    int n = 0, saved = 0;
+
+    if (!emittingRuntime) {
+        for (int r = destReg + 1; r < regCeiling && n < count; r++) {
+            if (r != otherReg) regs[n++] = r;
+        }
+        if (n < count && destReg != 7 && otherReg != 7) regs[n++] = 7;
+    }
+    for (int i = 0; n < count; i++) {
+        if (borrowOrder[i] == destReg || borrowOrder[i] == otherReg) continue;
+        regs[n++] = borrowOrder[i];
+        fprintf(out, "deca r5\nst r%d, (r5)\n", borrowOrder[i]);
+        saved++;
+    }
+    return saved;
+}
+
+/*
+ * EFFECTS: restores the regs acquireScratch borrowed, in reverse order
+*/
+static void releaseScratch(int *regs, int count, int saved)
+{
+    for (int i = count - 1; i >= count - saved; i--) {
+        fprintf(out, "ld (r5), r%d\ninca r5\n", regs[i]);
+    }
+}
+
+/*
+ * shr only takes amounts up to 31
+*/
+static void emitShiftRight(int amount, int reg)
+{
+    for (; amount > 31; amount -= 31) fprintf(out, "shr $31, r%d\n", reg);
+    if (amount > 0) fprintf(out, "shr $%d, r%d\n", amount, reg);
+}
+
+/*
+ * Computes reg / divisor, or reg % divisor if wantRemainder, for a compile time divisor without
+ * the bit serial loop. Rounds towards zero with the remainder taking the sign of the dividend,
+ * matching constant folding.
+ *
+ *  - 2^k divides by adding 2^k - 1 to negative dividends and shifting, and takes remainders
+ *    with a mask on the magnitude.
+ *  - anything else works on n = |x| (as ~x for negative x, so INT_MIN fits): q is estimated as
+ *    (n >> 1) * floor(2^33 / d) / 2^32 with one shr/add per digit of the reciprocal in non-adjacent
+ *    form, evaluated lowest digit first so truncation costs less than 2 overall. The estimate is
+ *    never high and at most 2 low, so two unrolled correction steps on r = n - q*d finish it.
+*/
+static void codegenConstDivision(int reg, int divisor, int wantRemainder)
+{
+    int tmp[3], saved, k, number = uniqueNum++;
+    unsigned d = divisor < 0 ? 0u - (unsigned)divisor : (unsigned)divisor;
+
+    if (d == 1) {
+        if (wantRemainder) fprintf(out, "ld $0, r%d\n", reg);
+        else if (divisor < 0) fprintf(out, "not r%d\ninc r%d\n", reg, reg);
+        return;
+    }
+    if (d == 0x80000000u) {
+        // only INT_MIN itself is divisible by INT_MIN
+        saved = acquireScratch(reg, -1, 1, tmp);
+        fprintf(out, "mov r%d, r%d\nld $0x80000000, r%d\nadd r%d, r%d\nbeq r%d, DV%d_MIN\n",
+            reg, tmp[0], reg, tmp[0], reg, reg, number);
+        if (wantRemainder) {
+            fprintf(out, "mov r%d, r%d\nDV%d_MIN:\n", tmp[0], reg, number);
+        } else {
+            fprintf(out, "ld $0, r%d\nbr DV%d_E\nDV%d_MIN:\nld $1, r%d\nDV%d_E:\n",
+                reg, number, number, reg, number);
+        }
+        releaseScratch(tmp, 1, saved);
+        return;
+    }
+    if ((d & (d - 1)) == 0) {
+        for (k = 0; (1u << k) != d; k++);
+        saved = acquireScratch(reg, -1, 1, tmp);
+        if (wantRemainder) {
+            fprintf(out,
+                "ld $%u, r%d\n"
+                "bgt r%d, DV%d_P\n"
+                "not r%d\n"
+                "inc r%d\n"
+                "and r%d, r%d\n"
+                "not r%d\n"
+                "inc r%d\n"
+                "br DV%d_E\n"
+                "DV%d_P:\n"
+                "and r%d, r%d\n"
+                "DV%d_E:\n",
+                d - 1, tmp[0], reg, number, reg, reg, tmp[0], reg, reg, reg, number,
+                number, tmp[0], reg, number);
+        } else {
+            // x + (s - (s << k)) where s = x >> 31 is 0 or -1
+            fprintf(out,
+                "mov r%d, r%d\n"
+                "shr $31, r%d\n"
+                "add r%d, r%d\n"
+                "shl $%d, r%d\n"
+                "not r%d\n"
+                "inc r%d\n"
+                "add r%d, r%d\n"
+                "shr $%d, r%d\n",
+                reg, tmp[0], tmp[0], tmp[0], reg, k, tmp[0], tmp[0], tmp[0], tmp[0], reg, k, reg);
+            if (divisor < 0) fprintf(out, "not r%d\ninc r%d\n", reg, reg);
+        }
+        releaseScratch(tmp, 1, saved);
+        return;
+    }
+
+    // q, h and -h (later d*q scratch)
+    saved = acquireScratch(reg, -1, 3, tmp);
+    int q = tmp[0], h = tmp[1], negh = tmp[2];
+    struct MulRecoding recip;
+    int hasNegative = 0, prev = -1;
+
+    recodeMultiplier((unsigned)((1ull << 33) / d), 1, 0, &recip);
+    for (k = 0; k < 32; k++) {
+        if (recip.digits[k] < 0) hasNegative = 1;
+    }
+    fprintf(out,
+        "mov r%d, r%d\n"
+        "shr $31, r%d\n"
+        "beq r%d, DV%d_A\n"
+        "not r%d\n"
+        "DV%d_A:\n"
+        "deca r5\n"
+        "st r%d, (r5)\t\t# save sign\n"
+        "mov r%d, r%d\n"
+        "shr $1, r%d\n",
+        reg, q, q, q, number, reg, number, q, reg, h, h);
+    if (hasNegative) fprintf(out, "mov r%d, r%d\nnot r%d\ninc r%d\n", h, negh, negh, negh);
+    for (k = 0; k < 32; k++) {
+        if (recip.digits[k] == 0) continue;
+        if (prev < 0) fprintf(out, "mov r%d, r%d\n", recip.digits[k] > 0 ? h : negh, q);
+        else {
+            emitShiftRight(k - prev, q);
+            fprintf(out, "add r%d, r%d\n", recip.digits[k] > 0 ? h : negh, q);
+        }
+        prev = k;
+    }
+    emitShiftRight(32 - prev, q);
+
+    // r = n + (1 if x was negative) - q*d, then q is corrected until r < d
+    fprintf(out, "mov r%d, r%d\n", q, h);
+    codegenConstMultiplication(h, (int)(0u - d), negh);
+    fprintf(out,
+        "add r%d, r%d\n"
+        "ld (r5), r%d\n"
+        "inca r5\n"
+        "beq r%d, DV%d_B\n"
+        "inc r%d\n"
+        "DV%d_B:\n"
+        "ld $%d, r%d\n",
+        h, reg, h, h, number, reg, number, (int)(1u - d), negh);
+    for (k = 0; k < 2; k++) {
+        fprintf(out, "add r%d, r%d\nbgt r%d, DV%d_C%d\nbr DV%d_F\nDV%d_C%d:\ndec r%d\n",
+            negh, reg, reg, number, k, number, number, k, reg);
+        if (!wantRemainder) fprintf(out, "inc r%d\n", q);
+    }
+    fprintf(out, "br DV%d_E\nDV%d_F:\nnot r%d\ninc r%d\nadd r%d, r%d\nDV%d_E:\n",
+        number, number, negh, negh, negh, reg, number);
+
+    // h still holds the sign of the dividend
+    if (wantRemainder) {
+        fprintf(out, "beq r%d, DV%d_S\nnot r%d\ninc r%d\nDV%d_S:\n", h, number, reg, reg, number);
+    } else {
+        if (divisor < 0) fprintf(out, "not r%d\n", h);
+        fprintf(out, "beq r%d, DV%d_S\nnot r%d\ninc r%d\nDV%d_S:\nmov r%d, r%d\n",
+            h, number, q, q, number, q, reg);
+    }
+    releaseScratch(tmp, 3, saved);
+}
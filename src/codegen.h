@@ -2,7 +2,18 @@
 #define SML_CODE_GENERATION_H
 
 #include "AST.h"
+#include "ir.h"
 
-void generateCode(struct AST *);
+/*
+ * What to favour when there is a choice: OPT_SIZE (-Os) shares one copy of the long dynamic
+ * operations between every use, OPT_SPEED (-O2) only for uses outside of loops.
+*/
+enum OptLevel {
+    OPT_DEFAULT,
+    OPT_SPEED,
+    OPT_SIZE
+};
+
+struct IRProgram *generateCode(struct AST *, enum OptLevel);
 
 #endif
\ No newline at end of file
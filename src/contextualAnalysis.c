@@ -24,6 +24,9 @@
  *  - ref pointers to their respective definition
  *  - frame index
  *  - isConstant
+ *  - hasSideEffects (so codegen knows when it may skip evaluating an operand)
+ *
+ * And to fold every constant expression (including uses of consts) into a single literal.
  * 
  * The typeless nature of SML means we don't really have that much to check.
 */
@@ -35,24 +38,35 @@
 #include "contextualAnalysis.h"
 #include "AST.h"
 #include "lex.h"
+#include "intern.h"
 
+/*
+ * Scoped symbol table. Symbols are dense, so the "hash table" is just an array indexed by symbol
+ * holding the innermost visible definition of each name - lookup is one load.
+ *
+ * defStack remembers, for every definition pushed, what it shadowed. Scopes are marked by
+ * remembering defIndex on entry, and leaving one pops back down to the mark, restoring
+ * whatever each popped definition had hidden.
+*/
 struct definition {
-	size_t startIndex;
-	size_t endIndex; 
-	struct ASTLinkedNode *def;
+	int symbol;
+	struct ASTLinkedNode *shadowed;
 };
 
+static struct ASTLinkedNode **visibleDef = NULL;
 static struct definition *defStack = NULL;
 static size_t defIndex = 0;
 static size_t defCap = 0;
 static int frameIndex = 0;
 
 static void initDefStack();
-static void pushDef(size_t start, size_t end, struct ASTLinkedNode *def);
+static void pushDef(int symbol, struct ASTLinkedNode *def);
 static void popDef();
-static void *searchForDef(size_t identifierStart, size_t identifierEnd);
+static void *searchForDef(int symbol);
 static void pass1(struct AST *tree);
 static void pass2(struct ASTLinkedNode *curr);
+static void foldConstantExpr(struct ASTLinkedNode *expr);
+static int foldOperation(int left, enum TokenType type, int right);
 
 /*
  * EFFECTS: invokes analysis functions in order to do complete analysis of given AST. 
@@ -80,7 +94,7 @@ static void pass1(struct AST *tree)
 		child = globaldec->val.children;
 		if (child->val.type == FN_DECL) {
 			ident = child->val.children;
-			pushDef(ident->val.startIndex, ident->val.endIndex, child);
+			pushDef(ident->val.symbol, child);
 		}
 	}
 }
@@ -112,7 +126,6 @@ static void pass2(struct ASTLinkedNode *curr)
 	struct ASTLinkedNode *singleCommand;
 	int oldIndex;
 	size_t startDefIndex;
-	char *name = NULL;
 	switch (curr->val.type) {
 	case FN_DECL:
 		// TODO: set pointer to string of identifier
@@ -122,9 +135,7 @@ static void pass2(struct ASTLinkedNode *curr)
 		singleCommand = params->next;
 		oldIndex = frameIndex;
 		for (frameIndex = 0, child = params->val.children; child != NULL; child = child->next, frameIndex++) {
-			name = malloc(child->val.endIndex - child->val.startIndex + 1);
-			getInputSubstr(name, child->val.startIndex, child->val.endIndex);
-			pushDef(child->val.startIndex, child->val.endIndex, child);
+			pushDef(child->val.symbol, child);
 			child->val.frameIndex = frameIndex;
 			child->val.isParam = 1;
 		}
@@ -145,45 +156,69 @@ static void pass2(struct ASTLinkedNode *curr)
 		// TODO: maybe insert a return statement in void functions at the end
 		break;
 	case CONST_DECL:
-		// TODO: set pointer to string of identifier
 		// TODO: ensure const names are unique
 		ident = curr->val.children;
-		pushDef(ident->val.startIndex, ident->val.endIndex, curr);
 		pass2(ident->next);
 		if (!ident->next->val.isConstant) {
-			name = calloc(curr->val.children->val.endIndex - curr->val.children->val.startIndex + 1, sizeof(*name));
-			getInputSubstr(name, curr->val.children->val.startIndex, curr->val.children->val.endIndex);
-			fprintf(stderr, "Constant values must be statically known, but `%s` is defined to non-statically known expression.\n", name);
+			fprintf(stderr, "Constant values must be statically known, but `%s` is defined to non-statically known expression.\n",
+				symbolName(ident->val.symbol));
 			exit(1);
 		}
+		// the initializer has been folded down to a literal by now
+		curr->val.val = ident->next->val.val;
+		curr->val.isConstant = 1;
+		pushDef(ident->val.symbol, curr);
 		break;
 	case VAR_DECL:
 		// TODO: set pointer to string of identifier
 		// TODO: ensure var names are unique
 		ident = curr->val.children;
 		ident->val.definition = NULL;
-		pushDef(ident->val.startIndex, ident->val.endIndex, curr);
+		pushDef(ident->val.symbol, curr);
 		curr->val.frameIndex = frameIndex++;
 		curr->val.isParam = 0;
 		if (ident->next) pass2(ident->next);
 		break;
 	case IDENT_REF:
-		curr->val.definition = searchForDef(curr->val.startIndex, curr->val.endIndex);
-		if (!curr->val.definition) {
-			name = calloc(curr->val.endIndex - curr->val.startIndex + 1, sizeof(*name));
-			getInputSubstr(name, curr->val.startIndex, curr->val.endIndex);
-			fprintf(stderr, "Could not find definition of `%s`.\n", name);
+		temp = searchForDef(curr->val.symbol);
+		if (!temp) {
+			fprintf(stderr, "Could not find definition of `%s`.\n", symbolName(curr->val.symbol));
+			exit(1);
+		}
+		if (temp->val.type == CONST_DECL) {
+			// consts never reach codegen - every use becomes the literal
+			curr->val.type = NUMBER_LITERAL;
+			curr->val.val = temp->val.val;
+			curr->val.isConstant = 1;
+			break;
+		}
+		curr->val.definition = temp;
+		break;
+	case DIRECT_ASSIGN:
+		ident = curr->val.children;
+		ident->val.definition = searchForDef(ident->val.symbol);
+		if (!ident->val.definition) {
+			fprintf(stderr, "Could not find definition of `%s`.\n", symbolName(ident->val.symbol));
 			exit(1);
 		}
+		if (ident->val.definition->val.type != VAR_DECL) {
+			fprintf(stderr, "Cannot assign to `%s`, it is not a variable.\n", symbolName(ident->val.symbol));
+			exit(1);
+		}
+		pass2(ident->next);
 		break;
 	case FUNC_CALL:
 		clobbersReturn = 1;
+		// the callee could assign to anything, so a call always counts
+		curr->val.hasSideEffects = 1;
 		ident = curr->val.children;
-		ident->val.definition = searchForDef(ident->val.startIndex, ident->val.endIndex);
+		ident->val.definition = searchForDef(ident->val.symbol);
 		if (!ident->val.definition) {
-			name = calloc(ident->val.endIndex - ident->val.startIndex + 1, sizeof(*name));
-			getInputSubstr(name, ident->val.startIndex, ident->val.endIndex);
-			fprintf(stderr, "Could not find definition of `%s`.\n", name);
+			fprintf(stderr, "Could not find definition of `%s`.\n", symbolName(ident->val.symbol));
+			exit(1);
+		}
+		if (ident->val.definition->val.type != FN_DECL) {
+			fprintf(stderr, "Cannot call `%s`, it is not a function.\n", symbolName(ident->val.symbol));
 			exit(1);
 		}
 		struct ASTLinkedNode *args = ident->next;
@@ -200,12 +235,19 @@ static void pass2(struct ASTLinkedNode *curr)
 		}
 		break;
 	case EXPR:
-		curr->val.isConstant = 1;
+		// a load from memory is never constant, even from a constant address
+		curr->val.isConstant = curr->val.operationType != DEREF;
 		for (child = curr->val.children; child != NULL; child = child->next) {
 			pass2(child);
 			if (!child->val.isConstant) {
 				curr->val.isConstant = 0;
 			}
+			if (child->val.hasSideEffects) {
+				curr->val.hasSideEffects = 1;
+			}
+		}
+		if (curr->val.isConstant) {
+			foldConstantExpr(curr);
 		}
 		break;
 	case COMMAND:
@@ -231,21 +273,126 @@ static void pass2(struct ASTLinkedNode *curr)
 }
 
 /*
- * REQUIRES: initDefStack has not yet been called
- * EFFECTS: initializes definition stack
+ * REQUIRES: every child of expr is a NUMBER_LITERAL.
+ * MODIFIES: expr
+ * EFFECTS: turns expr into a NUMBER_LITERAL holding the value the operation would compute at
+ *   runtime. Since children are analysed first, a whole constant subtree collapses bottom up.
+*/
+static void foldConstantExpr(struct ASTLinkedNode *expr)
+{
+	struct ASTLinkedNode *left = expr->val.children;
+	enum TokenType type = expr->val.operationType;
+	int ans;
+
+	if (left->next == NULL) {
+		switch (type) {
+		case NEGATE:
+			ans = (int)(0u - (unsigned)left->val.val);
+			break;
+		case BITWISE_NOT:
+			ans = ~left->val.val;
+			break;
+		case NOT:
+			ans = !left->val.val;
+			break;
+		default:
+			fprintf(stderr, "idk how to fold in prefix %s\n", TokenStrings[type]);
+			exit(1);
+		}
+	} else {
+		ans = foldOperation(left->val.val, type, left->next->val.val);
+	}
+	expr->val.type = NUMBER_LITERAL;
+	expr->val.children = NULL;
+	expr->val.val = ans;
+	expr->val.isConstant = 1;
+}
+
+/*
+ * EFFECTS: computes left `type` right exactly as the generated SM213 code would: 32 bit two's
+ *   complement with wraparound, division truncating towards zero, shifts of 32 or more
+ *   (or negative amounts) shifting everything out, right shifts being arithmetic and
+ *   comparisons looking at the sign of the wrapped difference.
+ *   Dividing by zero is reported here, since the program could never run correctly.
+*/
+static int foldOperation(int left, enum TokenType type, int right)
+{
+	unsigned l = left, r = right;
+
+	switch (type) {
+	case PLUS:
+		return (int)(l + r);
+	case MINUS:
+		return (int)(l - r);
+	case TIMES:
+		return (int)(l * r);
+	case DIVIDE:
+	case MODULO:
+		if (right == 0) {
+			fputs("Division by zero in constant expression.\n", stderr);
+			exit(1);
+		}
+		if (right == -1) {
+			// INT_MIN / -1 overflows in C, but simply wraps on the machine
+			return type == DIVIDE ? (int)(0u - l) : 0;
+		}
+		return type == DIVIDE ? left / right : left % right;
+	case LEFT_SHIFT:
+		return r >= 32 ? 0 : (int)(l << r);
+	case RIGHT_SHIFT:
+		if (r >= 32) return left < 0 ? -1 : 0;
+		return left < 0 ? (int)~(~l >> r) : (int)(l >> r);
+	// comparisons subtract and test the difference, which wraps for operands far apart
+	case LESS_THAN:
+		return (int)(r - l) > 0;
+	case LESS_THAN_EQUALS:
+		return (int)(r - l) >= 0;
+	case GREATER_THAN:
+		return (int)(l - r) > 0;
+	case GREATER_THAN_EQUALS:
+		return (int)(l - r) >= 0;
+	case EQUALS:
+		return left == right;
+	case NOT_EQUALS:
+		return left != right;
+	case OR:
+		return left || right;
+	case AND:
+		return left && right;
+	case BITWISE_AND:
+		return left & right;
+	case BITWISE_OR:
+		return left | right;
+	case BITWISE_XOR:
+		return left ^ right;
+	default:
+		fprintf(stderr, "idk how to fold in %s\n", TokenStrings[type]);
+		exit(1);
+	}
+}
+
+/*
+ * REQUIRES: every identifier has been interned (ie. parsing is done)
+ * EFFECTS: initializes definition stack and table, throwing out anything from a previous analysis
 */
 static void initDefStack()
 {
-	defCap = 4;
+	free(visibleDef);
+	free(defStack);
+	defCap = 64;
 	defIndex = 0;
-	defStack = calloc(4, sizeof(*defStack));
+	defStack = malloc(defCap * sizeof(*defStack));
+	visibleDef = calloc(symbolCount() + 1, sizeof(*visibleDef));
+	if (!defStack || !visibleDef) {
+		exit(1);
+	}
 }
 
 /*
  * REQUIRES: initDefStack has been called
- * EFFECTS: pushes definition with given characteristics to stack
+ * EFFECTS: makes def the visible definition of symbol until it is popped
 */
-static void pushDef(size_t start, size_t end, struct ASTLinkedNode *def)
+static void pushDef(int symbol, struct ASTLinkedNode *def)
 {
 	if (defIndex >= defCap) {
 		defCap *= 2;
@@ -253,38 +400,28 @@ static void pushDef(size_t start, size_t end, struct ASTLinkedNode *def)
 			exit(1);
 		}
 	}
-	defStack[defIndex].startIndex = start;
-	defStack[defIndex].endIndex = end;
-	defStack[defIndex].def = def;
+	defStack[defIndex].symbol = symbol;
+	defStack[defIndex].shadowed = visibleDef[symbol];
+	visibleDef[symbol] = def;
 	++defIndex;
 }
 
 /*
  * REQUIRES: initStackDef previously called, definition exists on stack.
- * EFFECTS: Removes last added definition from stack
+ * EFFECTS: Removes last added definition from stack, making whatever it shadowed visible again.
+ * The stack never shrinks - scopes come and go constantly and it will just grow back.
 */
 static void popDef()
 {
 	defIndex--;
-	if (defIndex * 2 < defCap) {
-		defCap /= 2;
-		if (!(defStack = realloc(defStack, sizeof(*defStack) * defCap))) {
-			exit(1);
-		}
-	}
+	visibleDef[defStack[defIndex].symbol] = defStack[defIndex].shadowed;
 }
 
 /*
  * REQUIRES: initDefStack been called
  * EFFECTS: produces pointer to identifier definition AST node if it is on stack, or null otherwise.
 */
-static void *searchForDef(size_t identifierStart, size_t identifierEnd)
+static void *searchForDef(int symbol)
 {
-	if (defIndex == 0) return NULL;
-	for (size_t i = defIndex; i > 0; i--) {
-		if (compareInputSubstr(identifierStart, identifierEnd, defStack[i - 1].startIndex, defStack[i - 1].endIndex)) {
-			return defStack[i - 1].def;
-		}
-	}
-	return NULL;
+	return visibleDef[symbol];
 }
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ *
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The last stage: writes the IR out as SM213 assembly, in layout order. Branches that
+ * relaxBranches marked long get their long form here.
+*/
+#include "emit.h"
+#include "intern.h"
+
+static int trampolineNum = 0;
+
+static void emitInstr(struct IRInstr *instr, FILE *out);
+
+/*
+ * REQUIRES: relaxBranches has been run on prog
+ * EFFECTS: writes prog to out as assembly
+*/
+void emitAssembly(struct IRProgram *prog, FILE *out)
+{
+    for (struct IRBlock *b = prog->blocks; b != NULL; b = b->next) {
+        int startsSection = (b->fn != NULL && b->fn->entry == b)
+            || (b->first != NULL && b->first->op == IR_POS);
+        if (startsSection && b != prog->blocks) fputc('\n', out);
+        for (int l = 0; l < b->labelCount; l++) {
+            fprintf(out, "%s:\n", symbolName(b->labels[l]));
+        }
+        for (struct IRInstr *i = b->first; i != NULL; i = i->next) {
+            emitInstr(i, out);
+        }
+    }
+}
+
+static void emitInstr(struct IRInstr *instr, FILE *out)
+{
+    if (instr->isLong && instr->op == IR_BR) {
+        fprintf(out, "j %s\n", symbolName(instr->symbol));
+        return;
+    }
+    if (instr->isLong) {
+        // there is no inverted beq / bgt, so hop over a j that the condition lands on
+        int n = trampolineNum++;
+        fprintf(out, "%s r%d, RB%dT\nbr RB%d\nRB%dT: j %s\nRB%d:\n", instr->op == IR_BEQ ? "beq" : "bgt",
+            instr->src, n, n, n, symbolName(instr->symbol), n);
+        return;
+    }
+    printInstr(instr, out);
+    if (instr->comment != NULL) fprintf(out, "\t\t# %s", instr->comment);
+    fputc('\n', out);
+}
@@ -0,0 +1,9 @@
+#ifndef SML_EMIT_H
+#define SML_EMIT_H
+
+#include <stdio.h>
+#include "ir.h"
+
+void emitAssembly(struct IRProgram *prog, FILE *out);
+
+#endif
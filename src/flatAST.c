@@ -0,0 +1,200 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ * 
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>. 
+ * 
+ * Builds the flat (index based, struct-of-arrays) form of a decorated AST.
+ * The flat tree is allocated with treeAlloc, so it goes away with the tree it came from.
+*/
+#include "flatAST.h"
+#include "AST.h"
+#include "lex.h"
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct nodeIndex {
+    struct ASTLinkedNode *node;
+    uint32_t index;
+};
+
+static uint32_t countNodes(struct ASTLinkedNode *n);
+static uint32_t flattenHelper(struct FlatAST *flat, struct ASTLinkedNode **nodes, struct ASTLinkedNode *n, uint32_t *next);
+static uint32_t findIndex(struct nodeIndex *sorted, uint32_t count, struct ASTLinkedNode *n);
+static int compareNodeIndex(const void *a, const void *b);
+static void printFlatHelper(struct FlatAST *flat, uint32_t i, int tabs);
+
+/*
+ * REQUIRES: tree has been analyzed
+ * EFFECTS: produces the flat form of tree, with every definition pointer turned into a node index.
+*/
+struct FlatAST *flattenTree(struct AST *tree)
+{
+    struct FlatAST *flat = treeAlloc(sizeof(*flat));
+    uint32_t count = countNodes(tree->root);
+    flat->count = count;
+    flat->kind = treeAlloc(count * sizeof(*flat->kind));
+    flat->isConstant = treeAlloc(count * sizeof(*flat->isConstant));
+    flat->symbol = treeAlloc(count * sizeof(*flat->symbol));
+    flat->firstChild = treeAlloc(count * sizeof(*flat->firstChild));
+    flat->nextSibling = treeAlloc(count * sizeof(*flat->nextSibling));
+    flat->subtreeSize = treeAlloc(count * sizeof(*flat->subtreeSize));
+    flat->payload = treeAlloc(count * sizeof(*flat->payload));
+
+    struct ASTLinkedNode **nodes = malloc(count * sizeof(*nodes));
+    struct nodeIndex *sorted = malloc(count * sizeof(*sorted));
+    if (count > 0 && (nodes == NULL || sorted == NULL)) {
+        fputs("Out of memory flattening tree\n", stderr);
+        exit(1);
+    }
+    uint32_t next = 0;
+    flattenHelper(flat, nodes, tree->root, &next);
+
+    // definitions can point anywhere in the tree (functions are used before they're declared),
+    // so they are resolved once every node has an index.
+    for (uint32_t i = 0; i < count; i++) {
+        sorted[i].node = nodes[i];
+        sorted[i].index = i;
+    }
+    qsort(sorted, count, sizeof(*sorted), compareNodeIndex);
+    for (uint32_t i = 0; i < count; i++) {
+        if (flat->kind[i] == IDENT_REF) {
+            flat->payload[i].definition = findIndex(sorted, count, nodes[i]->val.definition);
+        }
+    }
+    free(sorted);
+    free(nodes);
+    return flat;
+}
+
+static uint32_t countNodes(struct ASTLinkedNode *n)
+{
+    uint32_t ans = 1;
+    for (struct ASTLinkedNode *c = n->val.children; c != NULL; c = c->next) {
+        ans += countNodes(c);
+    }
+    return ans;
+}
+
+/*
+ * EFFECTS: copies n and its subtree into flat in pre-order starting at *next, produces n's index.
+*/
+static uint32_t flattenHelper(struct FlatAST *flat, struct ASTLinkedNode **nodes, struct ASTLinkedNode *n, uint32_t *next)
+{
+    uint32_t i = (*next)++;
+    nodes[i] = n;
+    flat->kind[i] = n->val.type;
+    flat->isConstant[i] = n->val.isConstant;
+    flat->symbol[i] = n->val.symbol;
+    flat->firstChild[i] = FLAT_NONE;
+    flat->nextSibling[i] = FLAT_NONE;
+    flat->payload[i].definition = FLAT_NONE;
+    switch (n->val.type) {
+    case VAR_DECL:
+        flat->payload[i].var.frameIndex = n->val.frameIndex;
+        flat->payload[i].var.isStatic = n->val.isStatic;
+        flat->payload[i].var.isParam = n->val.isParam;
+        break;
+    case FN_DECL:
+        flat->payload[i].fn.frameVars = n->val.frameVars;
+        flat->payload[i].fn.paramCount = n->val.paramCount;
+        flat->payload[i].fn.isVoid = n->val.isVoid;
+        flat->payload[i].fn.clobbersReturn = n->val.clobbersReturn;
+        break;
+    case EXPR:
+        flat->payload[i].operationType = n->val.operationType;
+        break;
+    case CONST_DECL:
+    case NUMBER_LITERAL:
+        flat->payload[i].val = n->val.val;
+        break;
+    default:
+        break;
+    }
+
+    uint32_t prev = FLAT_NONE;
+    for (struct ASTLinkedNode *c = n->val.children; c != NULL; c = c->next) {
+        uint32_t ci = flattenHelper(flat, nodes, c, next);
+        if (prev == FLAT_NONE) {
+            flat->firstChild[i] = ci;
+        } else {
+            flat->nextSibling[prev] = ci;
+        }
+        prev = ci;
+    }
+    flat->subtreeSize[i] = *next - i;
+    return i;
+}
+
+/*
+ * EFFECTS: produces index of n in the sorted map, or FLAT_NONE if n is not a node of the tree.
+*/
+static uint32_t findIndex(struct nodeIndex *sorted, uint32_t count, struct ASTLinkedNode *n)
+{
+    struct nodeIndex key = {n, 0};
+    struct nodeIndex *found = bsearch(&key, sorted, count, sizeof(*sorted), compareNodeIndex);
+    return found ? found->index : FLAT_NONE;
+}
+
+static int compareNodeIndex(const void *a, const void *b)
+{
+    const struct ASTLinkedNode *x = ((const struct nodeIndex *)a)->node;
+    const struct ASTLinkedNode *y = ((const struct nodeIndex *)b)->node;
+    return (x > y) - (x < y);
+}
+
+void printFlatTree(struct FlatAST *flat)
+{
+    if (flat->count > 0) {
+        printFlatHelper(flat, 0, 0);
+    }
+}
+
+static void printFlatHelper(struct FlatAST *flat, uint32_t i, int tabs)
+{
+    for (int t = 0; t < tabs; t++) printf("\t");
+    printf("#%u ", i);
+    switch (flat->kind[i]) {
+    case VAR_DECL:
+        if (flat->payload[i].var.isStatic) printf("static ");
+        if (flat->payload[i].var.isParam) printf("param ");
+        printf("index=%d ", flat->payload[i].var.frameIndex);
+        break;
+    case IDENT_REF:
+        if (flat->payload[i].definition != FLAT_NONE) printf("def=#%u ", flat->payload[i].definition);
+        break;
+    case EXPR:
+        printf("type=`%s` ", TokenStrings[flat->payload[i].operationType]);
+        break;
+    case CONST_DECL:
+    case NUMBER_LITERAL:
+        printf("val=`%d` ", flat->payload[i].val);
+        break;
+    default:
+        break;
+    }
+    if (flat->isConstant[i]) printf("const ");
+    if (flat->symbol[i] >= 0) printf("`%s` ", symbolName(flat->symbol[i]));
+    printf("%s", NODE_TYPE_STRINGS[flat->kind[i]]);
+    if (flat->firstChild[i] != FLAT_NONE) {
+        printf(" ->{\n");
+        for (uint32_t c = flat->firstChild[i]; c != FLAT_NONE; c = flat->nextSibling[c]) {
+            printFlatHelper(flat, c, tabs + 1);
+        }
+        for (int t = 0; t < tabs; t++) printf("\t");
+        printf("}");
+    }
+    printf("\n");
+}
@@ -0,0 +1,51 @@
+#ifndef SML_FLAT_AST_H
+#define SML_FLAT_AST_H
+
+#include <stdint.h>
+#include "AST.h"
+
+#define FLAT_NONE UINT32_MAX
+
+/*
+ * Per-node decorations that only make sense for some node types. 8 bytes, where
+ * the linked version is padded out to the size of its biggest member.
+*/
+union FlatPayload {
+    struct {
+        int32_t frameIndex;
+        uint8_t isStatic;
+        uint8_t isParam;
+    } var;
+    struct {
+        int32_t frameVars;
+        uint16_t paramCount;
+        uint8_t isVoid;
+        uint8_t clobbersReturn;
+    } fn;
+    int32_t operationType; // enum TokenType
+    int32_t val;
+    uint32_t definition; // node index
+};
+
+/*
+ * The AST, struct-of-arrays style. Node i is made of kind[i], firstChild[i], ... and every
+ * link is a 32 bit index (or FLAT_NONE) rather than a pointer.
+ *
+ * Nodes are stored in pre-order, so node 0 is the root, a node's first child is always right
+ * after it, and a subtree is the contiguous range [i, i + subtreeSize[i]).
+*/
+struct FlatAST {
+    uint32_t count;
+    uint8_t *kind; // enum NodeType
+    uint8_t *isConstant;
+    int32_t *symbol;
+    uint32_t *firstChild;
+    uint32_t *nextSibling;
+    uint32_t *subtreeSize;
+    union FlatPayload *payload;
+};
+
+struct FlatAST *flattenTree(struct AST *);
+void printFlatTree(struct FlatAST *);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ *
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The inliner, which runs on the analyzed tree. Besides whatever work it does, a call pays for
+ * allocating and storing its arguments, the gpc / j, the callee saving r6 and setting up its
+ * frame, and undoing all of that on the way back. For a small function that is most of the
+ * cost, so calls to it get a copy of its body instead.
+ *
+ * Only calls that make up a whole command are inlined - `f(x)`, `y = f(x)`, `var y = f(x)` and
+ * `return f(x)` - since there is no way to put commands inside an expression. The callee's
+ * parameters become locals of the caller set from the arguments, and its locals are copied
+ * along with the body, taking the next frame indices after the caller's own (regAlloc packs
+ * them down again, letting variables that are never live at once share a word). The copy goes
+ * in an INLINED_CALL node: its returns assign their value to wherever the call's result went
+ * and then leave the node, which codegen makes a branch to just past it. For `return f(x)`
+ * the copy is a plain command block and its returns simply return from the caller.
+ *
+ * Functions are visited callees first, so what gets copied has already had its own calls
+ * inlined. A call to a function that is still being visited is recursive and is left alone.
+ *
+ * A call is inlined if it is the only one to the callee (whose own copy then goes away, so the
+ * code only shrinks), or if the body is at most threshold nodes bigger than the call it
+ * replaces. A call in a loop pays its overhead every iteration, so it may grow the code more.
+*/
+#include "inline.h"
+#include "AST.h"
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// instructions a call costs besides its arguments: gpc and j there, the br to _RET and j back
+#define CALL_OVERHEAD 4
+// ld and st only reach 60 bytes past r5, so a caller's frame doesn't grow past this many words,
+// counting the words its calls pass arguments in
+#define MAX_FRAME_WORDS 12
+// loops deeper than this don't raise the budget any further
+#define MAX_BUDGET_DOUBLINGS 2
+
+enum VisitState {
+    UNVISITED,
+    VISITING,
+    VISITED
+};
+
+struct Callee {
+    struct ASTLinkedNode *decl; // NULL if the symbol doesn't name a function
+    enum VisitState state;
+    int sites; // calls to it still in the tree
+    int addressTaken;
+    int wasCalled; // before inlining, so if it has no calls left it's because of inlining
+    int size; // of its body, once visited
+    int frameWords; // most words of frame it needs at once, for its variables and parameters
+    int callWords; // arguments of the widest call it makes, once visited
+};
+
+/*
+ * Where the value of an inlined call goes
+*/
+enum ResultUse {
+    RESULT_DISCARDED,   // f(x)
+    RESULT_ASSIGNED,    // y = f(x) or var y = f(x)
+    RESULT_RETURNED     // return f(x)
+};
+
+/*
+ * A variable of the callee and the copy of it the caller gets
+*/
+struct Remap {
+    struct ASTLinkedNode *from, *to;
+};
+
+static struct Callee *callees = NULL; // by symbol
+static int threshold;
+static int mainSymbol;
+static struct ASTLinkedNode *caller;
+static int callerWords; // the frame words caller's own variables and parameters take
+static int inlinedWords; // most words any of the bodies inlined into caller takes
+static int loopDepth;
+static struct Remap *remaps = NULL;
+static size_t remapCount = 0;
+static size_t remapCap = 0;
+// what returns in the body being copied hand their value to
+static enum ResultUse resultUse;
+static struct ASTLinkedNode *resultVar;
+static int resultSymbol;
+
+static void countUses(struct ASTLinkedNode *node);
+static void visit(struct Callee *fn);
+static void visitCallees(struct ASTLinkedNode *node);
+static void inlineInCommand(struct ASTLinkedNode *command);
+static void tryInline(struct ASTLinkedNode *command, struct ASTLinkedNode *call, enum ResultUse use,
+    struct ASTLinkedNode *var, int varSymbol);
+static int worthInlining(struct Callee *callee);
+static struct ASTLinkedNode *copyTree(struct ASTLinkedNode *node);
+static void rewriteReturn(struct ASTLinkedNode *ret);
+static void addRemap(struct ASTLinkedNode *from, struct ASTLinkedNode *to);
+static struct ASTLinkedNode *remapped(struct ASTLinkedNode *def);
+static struct ASTLinkedNode *newNode(enum NodeType type, struct ASTLinkedNode *children);
+static struct ASTLinkedNode *newLocal(int symbol, struct ASTLinkedNode *value);
+static int endsInReturn(struct ASTLinkedNode *command);
+static int measure(struct ASTLinkedNode *node);
+static int containsCall(struct ASTLinkedNode *node);
+static int widestCall(struct ASTLinkedNode *node, struct ASTLinkedNode *skip);
+static void dropCalls(struct ASTLinkedNode *node);
+static void removeDeadFunctions(struct ASTLinkedNode *program);
+
+/*
+ * REQUIRES: tree has been through contextual analysis
+ * MODIFIES: tree
+ * EFFECTS: replaces the calls in tree that are worth it with the body of the function called,
+ *   and drops the functions that no longer have any calls because of it. A negative threshold
+ *   turns inlining off.
+*/
+void inlineFunctions(struct AST *tree, int inlineThreshold)
+{
+    struct ASTLinkedNode *global, *fn;
+    if (inlineThreshold < 0) return;
+    threshold = inlineThreshold;
+    mainSymbol = intern("main", 4);
+    free(callees);
+    callees = calloc(symbolCount() + 1, sizeof(*callees));
+    if (callees == NULL) {
+        fputs("Out of memory inlining\n", stderr);
+        exit(1);
+    }
+    for (global = tree->root->val.children; global != NULL; global = global->next) {
+        fn = global->val.children;
+        if (fn->val.type == FN_DECL) callees[fn->val.symbol].decl = fn;
+    }
+    countUses(tree->root);
+    for (size_t i = 0; i <= symbolCount(); i++) {
+        callees[i].wasCalled = callees[i].sites > 0;
+    }
+    for (global = tree->root->val.children; global != NULL; global = global->next) {
+        fn = global->val.children;
+        if (fn->val.type == FN_DECL && callees[fn->val.symbol].decl == fn
+                && callees[fn->val.symbol].state == UNVISITED) {
+            visit(&callees[fn->val.symbol]);
+        }
+    }
+    removeDeadFunctions(tree->root);
+    // a function whose calls were all inlined doesn't need to save r6 any more
+    for (global = tree->root->val.children; global != NULL; global = global->next) {
+        fn = global->val.children;
+        if (fn->val.type == FN_DECL) fn->val.clobbersReturn = containsCall(fn->val.children->next->next);
+    }
+}
+
+/*
+ * EFFECTS: counts the calls to every function under node, and notes the ones referred to other
+ *   than by calling them
+*/
+static void countUses(struct ASTLinkedNode *node)
+{
+    for (; node != NULL; node = node->next) {
+        if (node->val.type == FUNC_CALL) {
+            callees[node->val.children->val.symbol].sites++;
+            countUses(node->val.children->next);
+            continue;
+        }
+        if (node->val.type == IDENT_REF && node->val.definition != NULL
+                && node->val.definition->val.type == FN_DECL) {
+            callees[node->val.symbol].addressTaken = 1;
+        }
+        if (node->val.type != NUMBER_LITERAL) countUses(node->val.children);
+    }
+}
+
+/*
+ * EFFECTS: inlines what is worth it into fn, after doing the same for everything fn calls
+*/
+static void visit(struct Callee *fn)
+{
+    struct ASTLinkedNode *body = fn->decl->val.children->next->next;
+    fn->state = VISITING;
+    visitCallees(body);
+    caller = fn->decl;
+    callerWords = caller->val.frameVars + caller->val.paramCount;
+    inlinedWords = 0;
+    loopDepth = 0;
+    inlineInCommand(body);
+    fn->size = measure(body);
+    // inlined bodies' variables are dead outside of them, so regAlloc can share their words
+    fn->frameWords = callerWords + inlinedWords;
+    fn->callWords = widestCall(body, NULL);
+    fn->state = VISITED;
+}
+
+static void visitCallees(struct ASTLinkedNode *node)
+{
+    for (; node != NULL; node = node->next) {
+        if (node->val.type == FUNC_CALL) {
+            struct Callee *callee = &callees[node->val.children->val.symbol];
+            if (callee->decl != NULL && callee->state == UNVISITED) visit(callee);
+        }
+        if (node->val.type != NUMBER_LITERAL) visitCallees(node->val.children);
+    }
+}
+
+/*
+ * REQUIRES: command is a SINGLE_COMMAND or RETURN_DIRECTIVE in caller
+ * EFFECTS: inlines the calls in command that are worth it
+*/
+static void inlineInCommand(struct ASTLinkedNode *command)
+{
+    struct ASTLinkedNode *child = command->val.children, *value;
+    if (command->val.type == RETURN_DIRECTIVE) {
+        if (child != NULL && child->val.type == FUNC_CALL) {
+            tryInline(command, child, RESULT_RETURNED, NULL, -1);
+        }
+        return;
+    }
+    switch (child->val.type) {
+    case FUNC_CALL:
+        tryInline(command, child, RESULT_DISCARDED, NULL, child->val.children->val.symbol);
+        return;
+    case DIRECT_ASSIGN:
+        value = child->val.children->next;
+        if (value->val.type == FUNC_CALL) {
+            tryInline(command, value, RESULT_ASSIGNED, child->val.children->val.definition,
+                child->val.children->val.symbol);
+        }
+        return;
+    case VAR_DECL:
+        value = child->val.children->next;
+        if (value != NULL && value->val.type == FUNC_CALL) {
+            tryInline(command, value, RESULT_ASSIGNED, child, child->val.symbol);
+        }
+        return;
+    case IF_EXPR:
+        inlineInCommand(child->val.children->next);
+        if (child->val.children->next->next) inlineInCommand(child->val.children->next->next);
+        return;
+    case WHILE_LOOP:
+        loopDepth++;
+        inlineInCommand(child->val.children->next);
+        loopDepth--;
+        return;
+    case COMMAND:
+        for (value = child->val.children; value != NULL; value = value->next) {
+            inlineInCommand(value);
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+/*
+ * REQUIRES: call is what command calls, with its result used as use says. For RESULT_ASSIGNED,
+ *   var is the variable it goes in and varSymbol its name. For RESULT_DISCARDED, varSymbol
+ *   names the callee.
+ * MODIFIES: command
+ * EFFECTS: replaces command with a copy of the callee's body, if that is worth it
+*/
+static void tryInline(struct ASTLinkedNode *command, struct ASTLinkedNode *call, enum ResultUse use,
+    struct ASTLinkedNode *var, int varSymbol)
+{
+    struct Callee *callee = &callees[call->val.children->val.symbol];
+    struct ASTLinkedNode *fn = callee->decl, *param, *arg, *nextArg;
+    if (fn == NULL || callee->state != VISITED || !worthInlining(callee)) return;
+    // the caller's call area has to fit too, and this call's goes away but the callee's come along
+    int callWords = widestCall(caller->val.children->next->next, call);
+    if (callee->callWords > callWords) callWords = callee->callWords;
+    if (callerWords + callee->frameWords + callWords > MAX_FRAME_WORDS) return;
+    // a call with the wrong number of arguments was only warned about, so leave it be
+    int argCount = 0;
+    for (arg = call->val.children->next->val.children; arg != NULL; arg = arg->next) argCount++;
+    if (argCount != fn->val.paramCount) return;
+
+    // the parameters become locals set from the arguments, in order
+    struct ASTLinkedNode *body = NULL, **tail = &body;
+    remapCount = 0;
+    arg = call->val.children->next->val.children;
+    for (param = fn->val.children->next->val.children; param != NULL; param = param->next, arg = nextArg) {
+        nextArg = arg->next;
+        arg->next = NULL;
+        struct ASTLinkedNode *local = newLocal(param->val.symbol, arg);
+        addRemap(param, local);
+        *tail = newNode(SINGLE_COMMAND, local);
+        tail = &(*tail)->next;
+    }
+    resultUse = use;
+    resultVar = var;
+    resultSymbol = varSymbol;
+    *tail = copyTree(fn->val.children->next->next);
+    if (use == RESULT_RETURNED && !endsInReturn(*tail)) {
+        // the caller returned right after the call did
+        (*tail)->next = newNode(RETURN_DIRECTIVE, NULL);
+    }
+
+    struct ASTLinkedNode *replacement;
+    if (use == RESULT_RETURNED) {
+        replacement = newNode(SINGLE_COMMAND, newNode(COMMAND, body));
+    } else {
+        replacement = newNode(SINGLE_COMMAND, newNode(INLINED_CALL, body));
+        if (command->val.children->val.type == VAR_DECL) {
+            // declare it without a value, the inlined returns assign it
+            struct ASTLinkedNode *declare = newNode(SINGLE_COMMAND, command->val.children);
+            command->val.children->val.children->next = NULL;
+            declare->next = replacement;
+            replacement = newNode(SINGLE_COMMAND, newNode(COMMAND, declare));
+        }
+    }
+    command->val = replacement->val;
+    callee->sites--;
+    if (callee->frameWords > inlinedWords) inlinedWords = callee->frameWords;
+}
+
+static int worthInlining(struct Callee *callee)
+{
+    struct ASTLinkedNode *fn = callee->decl;
+    if (callee->sites == 1 && !callee->addressTaken && fn->val.symbol != mainSymbol) return 1;
+    int saved = CALL_OVERHEAD;
+    int budget = threshold;
+    for (int i = 0; i < loopDepth && i < MAX_BUDGET_DOUBLINGS; i++) budget *= 2;
+    return callee->size - saved <= budget;
+}
+
+/*
+ * EFFECTS: returns a copy of node and everything under it. References to variables remapped (or
+ *   declared in node) refer to the copies, and returns hand their value on as resultUse says.
+*/
+static struct ASTLinkedNode *copyTree(struct ASTLinkedNode *node)
+{
+    struct ASTLinkedNode *copy = treeAlloc(sizeof(*copy)), *child, **tail;
+    *copy = *node;
+    copy->next = NULL;
+    switch (node->val.type) {
+    case VAR_DECL:
+        // its own initializer can refer to it, so it is remapped before that is copied
+        addRemap(node, copy);
+        copy->val.frameIndex = caller->val.frameVars++;
+        break;
+    case IDENT_REF:
+        copy->val.definition = remapped(node->val.definition);
+        break;
+    case FUNC_CALL:
+        callees[node->val.children->val.symbol].sites++;
+        break;
+    default:
+        break;
+    }
+    tail = &copy->val.children;
+    for (child = node->val.children; child != NULL; child = child->next) {
+        *tail = copyTree(child);
+        tail = &(*tail)->next;
+    }
+    if (copy->val.type == RETURN_DIRECTIVE && resultUse != RESULT_RETURNED) rewriteReturn(copy);
+    return copy;
+}
+
+/*
+ * REQUIRES: ret is a RETURN_DIRECTIVE going in an INLINED_CALL
+ * MODIFIES: ret
+ * EFFECTS: turns ret into putting its value where the call's result goes followed by a return
+ *   without one, which leaves the INLINED_CALL. A value nobody uses is still evaluated if that
+ *   could have effects, into a local named after the callee.
+*/
+static void rewriteReturn(struct ASTLinkedNode *ret)
+{
+    struct ASTLinkedNode *value = ret->val.children, *use;
+    if (value == NULL) return;
+    ret->val.children = NULL;
+    if (resultUse == RESULT_ASSIGNED) {
+        struct ASTLinkedNode *target = newLinkedAstNode(IDENT_REF);
+        target->val.symbol = resultSymbol;
+        target->val.definition = resultVar;
+        target->next = value;
+        use = newNode(DIRECT_ASSIGN, target);
+    } else if (value->val.type == FUNC_CALL) {
+        use = value;
+    } else if (value->val.hasSideEffects) {
+        use = newLocal(resultSymbol, value);
+    } else {
+        return;
+    }
+    struct ASTLinkedNode *first = newNode(SINGLE_COMMAND, use);
+    first->next = newNode(RETURN_DIRECTIVE, NULL);
+    ret->val.type = SINGLE_COMMAND;
+    ret->val.children = newNode(COMMAND, first);
+}
+
+static void addRemap(struct ASTLinkedNode *from, struct ASTLinkedNode *to)
+{
+    if (remapCount == remapCap) {
+        remapCap = remapCap ? remapCap * 2 : 16;
+        remaps = realloc(remaps, remapCap * sizeof(*remaps));
+        if (remaps == NULL) {
+            fputs("Out of memory inlining\n", stderr);
+            exit(1);
+        }
+    }
+    remaps[remapCount].from = from;
+    remaps[remapCount].to = to;
+    remapCount++;
+}
+
+/*
+ * EFFECTS: returns the copy of def made for the body being inlined, or def itself if it is
+ *   declared outside of it
+*/
+static struct ASTLinkedNode *remapped(struct ASTLinkedNode *def)
+{
+    for (size_t i = 0; i < remapCount; i++) {
+        if (remaps[i].from == def) return remaps[i].to;
+    }
+    return def;
+}
+
+static struct ASTLinkedNode *newNode(enum NodeType type, struct ASTLinkedNode *children)
+{
+    struct ASTLinkedNode *node = newLinkedAstNode(type);
+    node->val.children = children;
+    return node;
+}
+
+/*
+ * EFFECTS: returns a new VAR_DECL of caller named symbol, set to value (which may be NULL)
+*/
+static struct ASTLinkedNode *newLocal(int symbol, struct ASTLinkedNode *value)
+{
+    struct ASTLinkedNode *ident = newLinkedAstNode(IDENT_REF);
+    ident->val.symbol = symbol;
+    ident->val.definition = NULL;
+    ident->next = value;
+    struct ASTLinkedNode *local = newNode(VAR_DECL, ident);
+    local->val.symbol = symbol;
+    local->val.isParam = 0;
+    local->val.reg = -1;
+    local->val.frameIndex = caller->val.frameVars++;
+    return local;
+}
+
+/*
+ * EFFECTS: returns whether every way through command ends in a return
+*/
+static int endsInReturn(struct ASTLinkedNode *command)
+{
+    struct ASTLinkedNode *child = command->val.children, *last;
+    if (command->val.type == RETURN_DIRECTIVE) return 1;
+    switch (child->val.type) {
+    case COMMAND:
+        for (last = child->val.children; last != NULL && last->next != NULL; last = last->next);
+        return last != NULL && endsInReturn(last);
+    case IF_EXPR:
+        return child->val.children->next->next != NULL && endsInReturn(child->val.children->next)
+            && endsInReturn(child->val.children->next->next);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * EFFECTS: returns roughly how much code node and its siblings compile to, in nodes that
+ *   generate some
+*/
+static int measure(struct ASTLinkedNode *node)
+{
+    int size = 0;
+    for (; node != NULL; node = node->next) {
+        switch (node->val.type) {
+        case CONST_DECL:
+            continue;
+        case SINGLE_COMMAND:
+        case COMMAND:
+        case ARG_LIST:
+        case INLINED_CALL:
+            break;
+        default:
+            size++;
+            break;
+        }
+        size += measure(node->val.children);
+    }
+    return size;
+}
+
+static int containsCall(struct ASTLinkedNode *node)
+{
+    for (; node != NULL; node = node->next) {
+        if (node->val.type == FUNC_CALL) return 1;
+        if (node->val.type != NUMBER_LITERAL && containsCall(node->val.children)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * EFFECTS: returns the most arguments any call under node but skip passes
+*/
+static int widestCall(struct ASTLinkedNode *node, struct ASTLinkedNode *skip)
+{
+    int widest = 0, words;
+    for (; node != NULL; node = node->next) {
+        if (node->val.type == FUNC_CALL && node != skip) {
+            words = node->val.children->val.definition->val.paramCount;
+            if (words > widest) widest = words;
+        }
+        if (node->val.type != NUMBER_LITERAL && (words = widestCall(node->val.children, skip)) > widest) {
+            widest = words;
+        }
+    }
+    return widest;
+}
+
+/*
+ * EFFECTS: forgets the calls under node, which is going away
+*/
+static void dropCalls(struct ASTLinkedNode *node)
+{
+    for (; node != NULL; node = node->next) {
+        if (node->val.type == FUNC_CALL) callees[node->val.children->val.symbol].sites--;
+        if (node->val.type != NUMBER_LITERAL) dropCalls(node->val.children);
+    }
+}
+
+/*
+ * EFFECTS: removes the functions that had calls, but lost all of them to inlining or to the
+ *   functions making them being removed. main and functions referred to
+ *   other than by a call always stay.
+*/
+static void removeDeadFunctions(struct ASTLinkedNode *program)
+{
+    int removedAny = 1;
+    while (removedAny) {
+        removedAny = 0;
+        struct ASTLinkedNode **link = &program->val.children;
+        while (*link != NULL) {
+            struct ASTLinkedNode *fn = (*link)->val.children;
+            struct Callee *callee = fn->val.type == FN_DECL ? &callees[fn->val.symbol] : NULL;
+            if (callee != NULL && callee->decl == fn && callee->wasCalled && callee->sites == 0
+                    && !callee->addressTaken && fn->val.symbol != mainSymbol) {
+                *link = (*link)->next;
+                callee->wasCalled = 0;
+                dropCalls(fn->val.children->next->next);
+                removedAny = 1;
+                continue;
+            }
+            link = &(*link)->next;
+        }
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef SML_INLINE_H
+#define SML_INLINE_H
+
+#include "AST.h"
+
+// how much bigger (in AST nodes) inlining a call may make the code, outside of loops
+#define INLINE_THRESHOLD 16
+
+void inlineFunctions(struct AST *tree, int threshold);
+
+#endif
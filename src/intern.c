@@ -0,0 +1,149 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ * 
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>. 
+ * 
+ * The interner hands every distinct identifier spelling a small integer (a symbol),
+ * starting at 0 and counting up. Two identifiers are the same name exactly when their
+ * symbols are equal, so nobody past the parser needs to look at the input text again.
+ * Each symbol also keeps one NUL-terminated copy of its spelling for codegen and errors.
+*/
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+extern const char *fullInput;
+
+struct symbol {
+	char *name;
+	size_t len;
+	uint32_t hash;
+};
+
+static struct symbol *symbols = NULL;
+static size_t symbolsLen = 0;
+static size_t symbolsCap = 0;
+
+// open addressing, holds symbol + 1 so that 0 means empty. Always a power of 2 in size.
+static int *slots = NULL;
+static size_t slotsCap = 0;
+
+static uint32_t hashStr(const char *s, size_t len);
+static void growSlots(void);
+
+/*
+ * EFFECTS: produces the symbol for the given spelling, making a new one if we haven't seen it.
+*/
+int intern(const char *s, size_t len)
+{
+	if (symbolsLen * 2 >= slotsCap) {
+		growSlots();
+	}
+	uint32_t hash = hashStr(s, len);
+	size_t i = hash & (slotsCap - 1);
+	while (slots[i] != 0) {
+		struct symbol *sym = &symbols[slots[i] - 1];
+		if (sym->hash == hash && sym->len == len && memcmp(sym->name, s, len) == 0) {
+			return slots[i] - 1;
+		}
+		i = (i + 1) & (slotsCap - 1);
+	}
+
+	if (symbolsLen == symbolsCap) {
+		symbolsCap = symbolsCap ? symbolsCap * 2 : 64;
+		symbols = realloc(symbols, symbolsCap * sizeof(*symbols));
+	}
+	char *name = malloc(len + 1);
+	if (symbols == NULL || name == NULL) {
+		fputs("Out of memory interning identifiers\n", stderr);
+		exit(1);
+	}
+	memcpy(name, s, len);
+	name[len] = '\0';
+	symbols[symbolsLen].name = name;
+	symbols[symbolsLen].len = len;
+	symbols[symbolsLen].hash = hash;
+	slots[i] = ++symbolsLen;
+	return symbolsLen - 1;
+}
+
+/*
+ * EFFECTS: interns the input text between the given indexes.
+*/
+int internInputSubstr(size_t start, size_t end)
+{
+	return intern(fullInput + start, end - start);
+}
+
+/*
+ * REQUIRES: sym was produced by intern
+ * EFFECTS: produces the spelling of sym. It lives until freeSymbols is called.
+*/
+const char *symbolName(int sym)
+{
+	return symbols[sym].name;
+}
+
+size_t symbolCount()
+{
+	return symbolsLen;
+}
+
+void freeSymbols()
+{
+	for (size_t i = 0; i < symbolsLen; i++) {
+		free(symbols[i].name);
+	}
+	free(symbols);
+	free(slots);
+	symbols = NULL;
+	slots = NULL;
+	symbolsLen = symbolsCap = slotsCap = 0;
+}
+
+/*
+ * FNV-1a. Identifiers are short, so anything fancier is a waste.
+*/
+static uint32_t hashStr(const char *s, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)s[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void growSlots()
+{
+	size_t newCap = slotsCap ? slotsCap * 2 : 128;
+	int *newSlots = calloc(newCap, sizeof(*newSlots));
+	if (newSlots == NULL) {
+		fputs("Out of memory interning identifiers\n", stderr);
+		exit(1);
+	}
+	for (size_t s = 0; s < symbolsLen; s++) {
+		size_t i = symbols[s].hash & (newCap - 1);
+		while (newSlots[i] != 0) {
+			i = (i + 1) & (newCap - 1);
+		}
+		newSlots[i] = s + 1;
+	}
+	free(slots);
+	slots = newSlots;
+	slotsCap = newCap;
+}
@@ -0,0 +1,12 @@
+#ifndef SML_INTERN_H
+#define SML_INTERN_H
+
+#include <unistd.h>
+
+int intern(const char *, size_t);
+int internInputSubstr(size_t, size_t);
+const char *symbolName(int);
+size_t symbolCount(void);
+void freeSymbols(void);
+
+#endif
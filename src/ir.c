@@ -0,0 +1,748 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ *
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The IR codegen lowers the analyzed AST to: SM213 instructions over the real registers, cut
+ * into basic blocks with the control flow between them, grouped into functions. Codegen picks
+ * the instructions; everything after it (branch relaxation, emitting the assembly, and any
+ * pass that needs to see more than one node at a time) works on this instead of on text.
+ *
+ * A block starts at a label or after anything that jumps, and a call (gpc + j) is a single
+ * instruction that doesn't end one. Functions are _start and everything called.
+*/
+#include "ir.h"
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_OPERANDS 3
+
+static const char *opNames[] = {
+    [IR_LD_IMM] = "ld", [IR_LD] = "ld", [IR_LD_IDX] = "ld", [IR_ST] = "st", [IR_ST_IDX] = "st",
+    [IR_MOV] = "mov", [IR_ADD] = "add", [IR_AND] = "and", [IR_INC] = "inc", [IR_INCA] = "inca",
+    [IR_DEC] = "dec", [IR_DECA] = "deca", [IR_NOT] = "not", [IR_SHL] = "shl", [IR_SHR] = "shr",
+    [IR_GPC] = "gpc", [IR_BR] = "br", [IR_BEQ] = "beq", [IR_BGT] = "bgt", [IR_J] = "j",
+    [IR_J_IND] = "j", [IR_CALL] = "call", [IR_HALT] = "halt", [IR_NOP] = "nop",
+    [IR_POS] = ".pos", [IR_LONG] = ".long"
+};
+
+static struct IRProgram *prog;
+static struct IRBlock *currBlock;
+static struct IRBlock *lastBlock;
+static const char *currLine;
+
+static void readLine(char *line);
+static struct IRInstr *readInstr(char *text);
+static void appendInstr(struct IRInstr *instr);
+static struct IRBlock *newBlock(void);
+static void addLabel(struct IRBlock *block, int symbol);
+static void findFunctions(void);
+static int endsBlock(struct IRInstr *instr);
+static int splitOperands(char *text, char **operands);
+static int readReg(const char *text);
+static void readImm(const char *text, long *imm, int *symbol);
+static void readMem(const char *text, struct IRInstr *instr);
+static int isLabelChar(char c);
+static void badInstr(void);
+static void printBlockHeader(struct IRBlock *block, FILE *out);
+
+/*
+ * REQUIRES: asmText is NUL terminated assembly for a whole program, as codegen writes it
+ * MODIFIES: asmText
+ * EFFECTS: produces the program as IR, with its CFG computed. Free it with freeIR.
+*/
+struct IRProgram *buildIR(char *asmText)
+{
+    prog = malloc(sizeof(*prog));
+    if (prog == NULL) {
+        fputs("Out of memory building IR\n", stderr);
+        exit(1);
+    }
+    prog->blocks = NULL;
+    prog->functions = NULL;
+    prog->blockCount = 0;
+    prog->arena.first = prog->arena.curr = NULL;
+    currBlock = lastBlock = NULL;
+
+    for (char *line = asmText; *line != '\0';) {
+        char *end = strchr(line, '\n');
+        if (end) *end = '\0';
+        readLine(line);
+        if (!end) break;
+        line = end + 1;
+    }
+
+    prog->symbolLimit = symbolCount();
+    prog->blockOfLabel = calloc(prog->symbolLimit ? prog->symbolLimit : 1, sizeof(*prog->blockOfLabel));
+    if (prog->blockOfLabel == NULL) {
+        fputs("Out of memory building IR\n", stderr);
+        exit(1);
+    }
+    for (struct IRBlock *b = prog->blocks; b != NULL; b = b->next) {
+        for (int i = 0; i < b->labelCount; i++) {
+            prog->blockOfLabel[b->labels[i]] = b;
+        }
+    }
+    findFunctions();
+    computeCFG(prog);
+    return prog;
+}
+
+/*
+ * MODIFIES: prog
+ * EFFECTS: recomputes every block's successors and how many predecessors it has, after a
+ *   pass has moved instructions or blocks around.
+*/
+void computeCFG(struct IRProgram *prog)
+{
+    struct IRBlock *b;
+    for (b = prog->blocks; b != NULL; b = b->next) {
+        b->succ[0] = b->succ[1] = NULL;
+        b->predCount = 0;
+    }
+    for (b = prog->blocks; b != NULL; b = b->next) {
+        if (b->fn == NULL) continue;
+        struct IRBlock *fallthrough = b->next != NULL && b->next->fn != NULL ? b->next : NULL;
+        struct IRInstr *last = b->last;
+        struct IRBlock *target = last != NULL && last->symbol >= 0 && (size_t)last->symbol < prog->symbolLimit
+            ? prog->blockOfLabel[last->symbol] : NULL;
+        switch (last != NULL ? last->op : IR_NOP) {
+        case IR_BR:
+        case IR_J:
+            b->succ[0] = target;
+            break;
+        case IR_BEQ:
+        case IR_BGT:
+            b->succ[0] = fallthrough;
+            b->succ[1] = target;
+            break;
+        case IR_J_IND:
+        case IR_HALT:
+            break;
+        default:
+            b->succ[0] = fallthrough;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (b->succ[i] != NULL) b->succ[i]->predCount++;
+        }
+    }
+}
+
+/*
+ * MODIFIES: prog
+ * EFFECTS: works out which registers are live leaving each block, from the CFG. Anything that
+ *   leaves the function (returning, or jumping somewhere unknown) is taken to need every
+ *   register but the scratch r7, and the stack pointer is always live.
+*/
+void computeLiveness(struct IRProgram *prog)
+{
+    struct IRBlock *b;
+    for (b = prog->blocks; b != NULL; b = b->next) {
+        b->liveOut = 0;
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (b = prog->blocks; b != NULL; b = b->next) {
+            if (b->fn == NULL) continue;
+            unsigned live = 1u << SP_REG;
+            struct IRInstr *last = b->last;
+            if (last != NULL && (last->op == IR_J_IND
+                    || ((last->op == IR_J || last->op == IR_BR) && b->succ[0] == NULL))) {
+                live |= ALL_REGS & ~(1u << 7);
+            }
+            for (int s = 0; s < 2; s++) {
+                struct IRBlock *succ = b->succ[s];
+                if (succ == NULL) continue;
+                // what succ needs on entry is what it needs after, minus what it writes first
+                unsigned in = succ->liveOut;
+                for (struct IRInstr *i = succ->last; i != NULL; i = i->prev) {
+                    in = (in & ~instrDefs(i)) | instrUses(i);
+                }
+                live |= in;
+            }
+            if (live != b->liveOut) {
+                b->liveOut = live;
+                changed = 1;
+            }
+        }
+    }
+}
+
+/*
+ * EFFECTS: returns the registers instr reads, as a bit set. A call might read anything.
+*/
+unsigned instrUses(struct IRInstr *instr)
+{
+    switch (instr->op) {
+    case IR_LD:
+    case IR_J_IND:
+        return 1u << instr->base;
+    case IR_LD_IDX:
+        return 1u << instr->base | 1u << instr->index;
+    case IR_ST:
+        return 1u << instr->src | 1u << instr->base;
+    case IR_ST_IDX:
+        return 1u << instr->src | 1u << instr->base | 1u << instr->index;
+    case IR_MOV:
+    case IR_BEQ:
+    case IR_BGT:
+        return 1u << instr->src;
+    case IR_ADD:
+    case IR_AND:
+        return 1u << instr->src | 1u << instr->dst;
+    case IR_INC:
+    case IR_INCA:
+    case IR_DEC:
+    case IR_DECA:
+    case IR_NOT:
+    case IR_SHL:
+    case IR_SHR:
+        return 1u << instr->dst;
+    case IR_CALL:
+        return ALL_REGS;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * EFFECTS: returns the registers instr is sure to overwrite, as a bit set. A call only counts
+ *   as writing its return address, since what the callee changes depends on the callee.
+*/
+unsigned instrDefs(struct IRInstr *instr)
+{
+    switch (instr->op) {
+    case IR_ST:
+    case IR_ST_IDX:
+    case IR_BR:
+    case IR_BEQ:
+    case IR_BGT:
+    case IR_J:
+    case IR_J_IND:
+    case IR_HALT:
+    case IR_NOP:
+    case IR_POS:
+    case IR_LONG:
+        return 0;
+    default:
+        return 1u << instr->dst;
+    }
+}
+
+/*
+ * REQUIRES: computeLiveness has been run since instructions after instr in block last changed
+ *   in a way that adds uses
+ * EFFECTS: returns whether what is in reg right after instr could still be read
+*/
+int isLiveAfter(struct IRBlock *block, struct IRInstr *instr, int reg)
+{
+    if (reg == SP_REG) return 1;
+    for (struct IRInstr *i = instr->next; i != NULL; i = i->next) {
+        if (instrUses(i) & 1u << reg) return 1;
+        if (instrDefs(i) & 1u << reg) return 0;
+    }
+    return (block->liveOut >> reg) & 1;
+}
+
+/*
+ * EFFECTS: produces how many bytes instr assembles to, given whether it has been widened
+*/
+int instrSize(struct IRInstr *instr)
+{
+    switch (instr->op) {
+    case IR_LD_IMM:
+    case IR_J:
+        return 6;
+    case IR_CALL:
+        return 8;
+    case IR_LONG:
+        return 4;
+    case IR_POS:
+        return 0;
+    case IR_BR:
+        return instr->isLong ? 6 : 2;
+    case IR_BEQ:
+    case IR_BGT:
+        return instr->isLong ? 10 : 2;
+    default:
+        return 2;
+    }
+}
+
+/*
+ * EFFECTS: writes instr as SM213 assembly, without a trailing newline. A call is two lines.
+*/
+void printInstr(struct IRInstr *instr, FILE *out)
+{
+    const char *name = opNames[instr->op];
+    switch (instr->op) {
+    case IR_LD_IMM:
+        if (instr->symbol >= 0) fprintf(out, "ld $%s, r%d", symbolName(instr->symbol), instr->dst);
+        else fprintf(out, "ld $%ld, r%d", instr->imm, instr->dst);
+        break;
+    case IR_LD:
+        if (instr->imm != 0) fprintf(out, "ld %ld(r%d), r%d", instr->imm, instr->base, instr->dst);
+        else fprintf(out, "ld (r%d), r%d", instr->base, instr->dst);
+        break;
+    case IR_LD_IDX:
+        fprintf(out, "ld (r%d, r%d, 4), r%d", instr->base, instr->index, instr->dst);
+        break;
+    case IR_ST:
+        if (instr->imm != 0) fprintf(out, "st r%d, %ld(r%d)", instr->src, instr->imm, instr->base);
+        else fprintf(out, "st r%d, (r%d)", instr->src, instr->base);
+        break;
+    case IR_ST_IDX:
+        fprintf(out, "st r%d, (r%d, r%d, 4)", instr->src, instr->base, instr->index);
+        break;
+    case IR_MOV:
+    case IR_ADD:
+    case IR_AND:
+        fprintf(out, "%s r%d, r%d", name, instr->src, instr->dst);
+        break;
+    case IR_INC:
+    case IR_INCA:
+    case IR_DEC:
+    case IR_DECA:
+    case IR_NOT:
+        fprintf(out, "%s r%d", name, instr->dst);
+        break;
+    case IR_SHL:
+    case IR_SHR:
+    case IR_GPC:
+        fprintf(out, "%s $%ld, r%d", name, instr->imm, instr->dst);
+        break;
+    case IR_BR:
+    case IR_J:
+        fprintf(out, "%s %s", name, symbolName(instr->symbol));
+        break;
+    case IR_BEQ:
+    case IR_BGT:
+        fprintf(out, "%s r%d, %s", name, instr->src, symbolName(instr->symbol));
+        break;
+    case IR_J_IND:
+        if (instr->imm != 0) fprintf(out, "j %ld(r%d)", instr->imm, instr->base);
+        else fprintf(out, "j (r%d)", instr->base);
+        break;
+    case IR_CALL:
+        fprintf(out, "gpc $6, r%d\nj %s", instr->dst, symbolName(instr->symbol));
+        break;
+    case IR_HALT:
+    case IR_NOP:
+        fputs(name, out);
+        break;
+    case IR_POS:
+        fprintf(out, ".pos 0x%lX", instr->imm);
+        break;
+    case IR_LONG:
+        if (instr->symbol >= 0) fprintf(out, ".long %s", symbolName(instr->symbol));
+        else fprintf(out, ".long %ld", instr->imm);
+        break;
+    }
+}
+
+/*
+ * EFFECTS: writes a readable listing of prog to out: each function's blocks, with their
+ *   predecessor counts and successors. Runs of the same data word are shown once.
+*/
+void dumpIR(struct IRProgram *prog, FILE *out)
+{
+    struct IRFunction *fn = NULL;
+    for (struct IRBlock *b = prog->blocks; b != NULL; b = b->next) {
+        if (b == prog->blocks || b->fn != fn) {
+            fn = b->fn;
+            if (fn != NULL) fprintf(out, "\nfunction %s\n", symbolName(fn->symbol));
+            else fputs("\ndata\n", out);
+        }
+        printBlockHeader(b, out);
+        for (struct IRInstr *i = b->first; i != NULL; i = i->next) {
+            fputs("    ", out);
+            if (i->op == IR_CALL) {
+                fprintf(out, "call %s, r%d", symbolName(i->symbol), i->dst);
+            } else {
+                printInstr(i, out);
+            }
+            if (i->op == IR_LONG) {
+                int run = 1;
+                while (i->next != NULL && i->next->op == IR_LONG && i->next->imm == i->imm
+                        && i->next->symbol == i->symbol) {
+                    i = i->next;
+                    run++;
+                }
+                if (run > 1) fprintf(out, "\t\t# x%d", run);
+            } else if (i->comment != NULL) {
+                fprintf(out, "\t\t# %s", i->comment);
+            }
+            fputc('\n', out);
+        }
+        if (b->fn == NULL) continue;
+        if (b->succ[0] == NULL && b->succ[1] == NULL) {
+            fputs("    -> exit\n", out);
+        } else {
+            fprintf(out, "    -> bb%d", b->succ[0] != NULL ? b->succ[0]->id : b->succ[1]->id);
+            if (b->succ[0] != NULL && b->succ[1] != NULL) fprintf(out, ", bb%d", b->succ[1]->id);
+            fputc('\n', out);
+        }
+    }
+}
+
+void freeIR(struct IRProgram *prog)
+{
+    arenaFree(&prog->arena);
+    free(prog->blockOfLabel);
+    free(prog);
+}
+
+static void printBlockHeader(struct IRBlock *b, FILE *out)
+{
+    fprintf(out, "bb%d:", b->id);
+    for (int i = 0; i < b->labelCount; i++) {
+        fprintf(out, " %s", symbolName(b->labels[i]));
+    }
+    if (b->fn != NULL) fprintf(out, "\t\t# preds %d", b->predCount);
+    fputc('\n', out);
+}
+
+/*
+ * EFFECTS: adds the labels and instruction on line to the program being built
+*/
+static void readLine(char *line)
+{
+    currLine = line;
+    char *p = line;
+    for (;;) {
+        while (isspace((unsigned char)*p)) p++;
+        char *name = p;
+        while (isLabelChar(*p)) p++;
+        if (p == name || *p != ':') {
+            p = name;
+            break;
+        }
+        if (currBlock == NULL || currBlock->first != NULL) {
+            currBlock = newBlock();
+        }
+        addLabel(currBlock, intern(name, p - name));
+        p++;
+    }
+
+    char *comment = strchr(p, '#');
+    if (comment != NULL) {
+        *comment++ = '\0';
+        while (isspace((unsigned char)*comment)) comment++;
+    }
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0') return;
+
+    struct IRInstr *instr = readInstr(p);
+    if (comment != NULL && *comment != '\0') {
+        size_t len = strlen(comment);
+        while (len > 0 && isspace((unsigned char)comment[len - 1])) len--;
+        char *copy = arenaAlloc(&prog->arena, len + 1);
+        memcpy(copy, comment, len);
+        copy[len] = '\0';
+        instr->comment = copy;
+    }
+    appendInstr(instr);
+}
+
+/*
+ * EFFECTS: produces the instruction text (with no labels or comment) is, or exits if codegen
+ *   wrote something this doesn't understand.
+*/
+static struct IRInstr *readInstr(char *text)
+{
+    struct IRInstr *instr = arenaAlloc(&prog->arena, sizeof(*instr));
+    instr->src = instr->dst = instr->base = instr->index = instr->symbol = -1;
+    instr->imm = 0;
+    instr->comment = NULL;
+    instr->isLong = 0;
+    instr->prev = instr->next = NULL;
+
+    char *name = text;
+    while (*text != '\0' && !isspace((unsigned char)*text)) text++;
+    if (*text != '\0') *text++ = '\0';
+    char *ops[MAX_OPERANDS];
+    int n = splitOperands(text, ops);
+
+    if (strcmp(name, "ld") == 0 && n == 2) {
+        instr->dst = readReg(ops[1]);
+        if (ops[0][0] == '$') {
+            instr->op = IR_LD_IMM;
+            readImm(ops[0], &instr->imm, &instr->symbol);
+        } else {
+            instr->op = IR_LD;
+            readMem(ops[0], instr);
+        }
+    } else if (strcmp(name, "st") == 0 && n == 2) {
+        instr->op = IR_ST;
+        instr->src = readReg(ops[0]);
+        readMem(ops[1], instr);
+    } else if ((strcmp(name, "mov") == 0 || strcmp(name, "add") == 0 || strcmp(name, "and") == 0) && n == 2) {
+        instr->op = name[0] == 'm' ? IR_MOV : name[1] == 'd' ? IR_ADD : IR_AND;
+        instr->src = readReg(ops[0]);
+        instr->dst = readReg(ops[1]);
+    } else if ((strcmp(name, "shl") == 0 || strcmp(name, "shr") == 0 || strcmp(name, "gpc") == 0) && n == 2) {
+        instr->op = name[0] == 'g' ? IR_GPC : name[2] == 'l' ? IR_SHL : IR_SHR;
+        readImm(ops[0], &instr->imm, &instr->symbol);
+        instr->dst = readReg(ops[1]);
+        if (instr->symbol >= 0) badInstr();
+    } else if ((strcmp(name, "beq") == 0 || strcmp(name, "bgt") == 0) && n == 2) {
+        instr->op = name[1] == 'e' ? IR_BEQ : IR_BGT;
+        instr->src = readReg(ops[0]);
+        instr->symbol = intern(ops[1], strlen(ops[1]));
+    } else if (strcmp(name, "br") == 0 && n == 1) {
+        instr->op = IR_BR;
+        instr->symbol = intern(ops[0], strlen(ops[0]));
+    } else if (strcmp(name, "j") == 0 && n == 1) {
+        if (strchr(ops[0], '(') != NULL) {
+            instr->op = IR_J_IND;
+            readMem(ops[0], instr);
+            if (instr->index >= 0) badInstr();
+        } else {
+            instr->op = IR_J;
+            instr->symbol = intern(ops[0], strlen(ops[0]));
+        }
+    } else if (strcmp(name, ".pos") == 0 && n == 1) {
+        instr->op = IR_POS;
+        readImm(ops[0], &instr->imm, &instr->symbol);
+        if (instr->symbol >= 0) badInstr();
+    } else if (strcmp(name, ".long") == 0 && n == 1) {
+        instr->op = IR_LONG;
+        readImm(ops[0], &instr->imm, &instr->symbol);
+    } else if (n == 1) {
+        static const struct { const char *name; enum IROpcode op; } unary[] = {
+            {"inc", IR_INC}, {"inca", IR_INCA}, {"dec", IR_DEC}, {"deca", IR_DECA}, {"not", IR_NOT}
+        };
+        size_t i;
+        for (i = 0; i < sizeof(unary) / sizeof(unary[0]) && strcmp(name, unary[i].name) != 0; i++);
+        if (i == sizeof(unary) / sizeof(unary[0])) badInstr();
+        instr->op = unary[i].op;
+        instr->dst = readReg(ops[0]);
+    } else if (n == 0 && (strcmp(name, "halt") == 0 || strcmp(name, "nop") == 0)) {
+        instr->op = name[0] == 'h' ? IR_HALT : IR_NOP;
+    } else {
+        badInstr();
+    }
+    return instr;
+}
+
+/*
+ * EFFECTS: adds instr to the end of the current block, starting a new one first if the
+ *   current one can't take it. A gpc followed by a j to a label becomes one call.
+*/
+static void appendInstr(struct IRInstr *instr)
+{
+    struct IRInstr *last = currBlock != NULL ? currBlock->last : NULL;
+    if (instr->op == IR_J && last != NULL && last->op == IR_GPC && last->imm == 6) {
+        last->op = IR_CALL;
+        last->symbol = instr->symbol;
+        if (last->comment == NULL) last->comment = instr->comment;
+        return;
+    }
+    if (currBlock == NULL || (last != NULL && endsBlock(last))
+            || (instr->op == IR_POS && currBlock->first != NULL)) {
+        currBlock = newBlock();
+    }
+    instr->prev = currBlock->last;
+    if (currBlock->last != NULL) currBlock->last->next = instr;
+    else currBlock->first = instr;
+    currBlock->last = instr;
+}
+
+static struct IRBlock *newBlock()
+{
+    struct IRBlock *b = arenaAlloc(&prog->arena, sizeof(*b));
+    b->id = prog->blockCount++;
+    b->labels = NULL;
+    b->labelCount = 0;
+    b->first = b->last = NULL;
+    b->succ[0] = b->succ[1] = NULL;
+    b->predCount = 0;
+    b->fn = NULL;
+    b->liveOut = 0;
+    b->addr = 0;
+    b->next = NULL;
+    if (lastBlock != NULL) lastBlock->next = b;
+    else prog->blocks = b;
+    lastBlock = b;
+    return b;
+}
+
+static void addLabel(struct IRBlock *b, int symbol)
+{
+    // blocks rarely have more than a couple of labels, so just copy them over each time
+    int *labels = arenaAlloc(&prog->arena, (b->labelCount + 1) * sizeof(*labels));
+    if (b->labelCount) memcpy(labels, b->labels, b->labelCount * sizeof(*labels));
+    labels[b->labelCount++] = symbol;
+    b->labels = labels;
+}
+
+/*
+ * EFFECTS: groups the code blocks into functions, each starting at _start or something called.
+ *   Blocks of data belong to none.
+*/
+static void findFunctions()
+{
+    char *isEntry = calloc(prog->symbolLimit ? prog->symbolLimit : 1, 1);
+    if (isEntry == NULL) {
+        fputs("Out of memory building IR\n", stderr);
+        exit(1);
+    }
+    isEntry[intern("_start", 6)] = 1;
+    struct IRBlock *b;
+    struct IRInstr *i;
+    for (b = prog->blocks; b != NULL; b = b->next) {
+        for (i = b->first; i != NULL; i = i->next) {
+            if (i->op == IR_CALL) isEntry[i->symbol] = 1;
+        }
+    }
+
+    struct IRFunction *fn = NULL, *lastFn = NULL;
+    for (b = prog->blocks; b != NULL; b = b->next) {
+        if (b->first != NULL && (b->first->op == IR_POS || b->first->op == IR_LONG)) {
+            if (fn != NULL) fn->end = b;
+            fn = NULL;
+            continue;
+        }
+        for (int l = 0; l < b->labelCount; l++) {
+            if (!isEntry[b->labels[l]]) continue;
+            if (fn != NULL) fn->end = b;
+            fn = arenaAlloc(&prog->arena, sizeof(*fn));
+            fn->symbol = b->labels[l];
+            fn->entry = b;
+            fn->end = NULL;
+            fn->next = NULL;
+            if (lastFn != NULL) lastFn->next = fn;
+            else prog->functions = fn;
+            lastFn = fn;
+            break;
+        }
+        b->fn = fn;
+    }
+    free(isEntry);
+}
+
+static int endsBlock(struct IRInstr *instr)
+{
+    switch (instr->op) {
+    case IR_BR:
+    case IR_BEQ:
+    case IR_BGT:
+    case IR_J:
+    case IR_J_IND:
+    case IR_HALT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * MODIFIES: text
+ * EFFECTS: splits text into at most MAX_OPERANDS operands, on commas or spaces that aren't
+ *   inside parentheses, and produces how many there were.
+*/
+static int splitOperands(char *text, char **operands)
+{
+    int n = 0, depth = 0;
+    char *start = NULL;
+    for (char *p = text;; p++) {
+        if (*p == '(') depth++;
+        else if (*p == ')') depth--;
+        int isSeparator = *p == '\0' || (depth == 0 && (*p == ',' || isspace((unsigned char)*p)));
+        if (!isSeparator) {
+            if (start == NULL) start = p;
+            continue;
+        }
+        if (start != NULL) {
+            if (n == MAX_OPERANDS) badInstr();
+            operands[n++] = start;
+            start = NULL;
+        }
+        if (*p == '\0') break;
+        *p = '\0';
+    }
+    return n;
+}
+
+static int readReg(const char *text)
+{
+    if (text[0] != 'r' || text[1] < '0' || text[1] > '7' || text[2] != '\0') badInstr();
+    return text[1] - '0';
+}
+
+/*
+ * EFFECTS: reads a number or label, with or without a leading $, into imm or symbol
+*/
+static void readImm(const char *text, long *imm, int *symbol)
+{
+    if (*text == '$') text++;
+    char *end;
+    *imm = strtol(text, &end, 0);
+    if (end != text && *end == '\0') return;
+    size_t len = strlen(text);
+    if (len == 0 || isdigit((unsigned char)*text)) badInstr();
+    for (size_t i = 0; i < len; i++) {
+        if (!isLabelChar(text[i])) badInstr();
+    }
+    *imm = 0;
+    *symbol = intern(text, len);
+}
+
+/*
+ * EFFECTS: reads a memory operand, off(rB) or (rB, rI, 4), into instr, turning a plain load
+ *   or store into the indexed kind for the latter.
+*/
+static void readMem(const char *text, struct IRInstr *instr)
+{
+    char *end;
+    const char *open = strchr(text, '(');
+    if (open == NULL || text[strlen(text) - 1] != ')') badInstr();
+    instr->imm = open == text ? 0 : strtol(text, &end, 0);
+    if (open != text && end != open) badInstr();
+
+    char regs[3][8];
+    int n = 0;
+    const char *p = open + 1;
+    while (n < 3) {
+        while (isspace((unsigned char)*p)) p++;
+        size_t len = strcspn(p, ",)");
+        while (len > 0 && isspace((unsigned char)p[len - 1])) len--;
+        if (len == 0 || len >= sizeof(regs[0])) badInstr();
+        memcpy(regs[n], p, len);
+        regs[n++][len] = '\0';
+        p += strcspn(p, ",)");
+        if (*p++ == ')') break;
+    }
+    instr->base = readReg(regs[0]);
+    if (n == 1) return;
+    if (n != 3 || strcmp(regs[2], "4") != 0 || instr->imm != 0) badInstr();
+    instr->index = readReg(regs[1]);
+    instr->op = instr->op == IR_LD ? IR_LD_IDX : IR_ST_IDX;
+}
+
+static int isLabelChar(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+static void badInstr()
+{
+    fprintf(stderr, "Internal error: codegen wrote an instruction the IR can't hold: %s\n", currLine);
+    exit(1);
+}
@@ -0,0 +1,100 @@
+#ifndef SML_IR_H
+#define SML_IR_H
+
+#include <stdio.h>
+#include "arena.h"
+
+#define SP_REG 5
+#define ALL_REGS 0xffu
+
+/*
+ * One SM213 instruction (or assembler directive). Which of the fields mean anything depends
+ * on op, the rest are -1.
+*/
+enum IROpcode {
+    IR_LD_IMM,  // ld $imm, rDst                (imm is symbol's address when symbol != -1)
+    IR_LD,      // ld imm(rBase), rDst
+    IR_LD_IDX,  // ld (rBase, rIndex, 4), rDst
+    IR_ST,      // st rSrc, imm(rBase)
+    IR_ST_IDX,  // st rSrc, (rBase, rIndex, 4)
+    IR_MOV,     // mov rSrc, rDst
+    IR_ADD,     // add rSrc, rDst
+    IR_AND,     // and rSrc, rDst
+    IR_INC,     // inc rDst
+    IR_INCA,    // inca rDst
+    IR_DEC,     // dec rDst
+    IR_DECA,    // deca rDst
+    IR_NOT,     // not rDst
+    IR_SHL,     // shl $imm, rDst
+    IR_SHR,     // shr $imm, rDst
+    IR_GPC,     // gpc $imm, rDst
+    IR_BR,      // br symbol
+    IR_BEQ,     // beq rSrc, symbol
+    IR_BGT,     // bgt rSrc, symbol
+    IR_J,       // j symbol
+    IR_J_IND,   // j imm(rBase)
+    IR_CALL,    // gpc $6, rDst / j symbol, returning to the next instruction
+    IR_HALT,
+    IR_NOP,
+    IR_POS,     // .pos imm
+    IR_LONG     // .long imm (or symbol)
+};
+
+struct IRInstr {
+    enum IROpcode op;
+    int src, dst, base, index;
+    long imm;
+    int symbol;
+    const char *comment; // NULL if none
+    int isLong; // a branch relaxBranches found can't reach, emitted as a j
+    struct IRInstr *prev, *next;
+};
+
+/*
+ * A straight run of instructions: only the first can be jumped to and only the last can
+ * jump. labels are the labels that name its first instruction.
+*/
+struct IRBlock {
+    int id;
+    int *labels;
+    int labelCount;
+    struct IRInstr *first, *last;
+    struct IRBlock *succ[2]; // where control goes next: [0] falls through or is the only way, [1] is a taken branch
+    int predCount;
+    struct IRFunction *fn; // NULL for data
+    unsigned char liveOut; // registers (bit i for ri) read before being written after the block, from computeLiveness
+    unsigned long addr; // filled in by relaxBranches
+    struct IRBlock *next; // in layout order
+};
+
+/*
+ * A function is the run of blocks (in layout order) from the one named by its label up to
+ * the next function's, or the data. Calls don't end a block.
+*/
+struct IRFunction {
+    int symbol;
+    struct IRBlock *entry, *end; // blocks [entry, end)
+    struct IRFunction *next;
+};
+
+struct IRProgram {
+    struct IRBlock *blocks;
+    struct IRFunction *functions;
+    int blockCount;
+    struct IRBlock **blockOfLabel; // by symbol, NULL if the symbol doesn't label a block
+    size_t symbolLimit;
+    struct Arena arena;
+};
+
+struct IRProgram *buildIR(char *asmText);
+void computeCFG(struct IRProgram *prog);
+void computeLiveness(struct IRProgram *prog);
+unsigned instrUses(struct IRInstr *instr);
+unsigned instrDefs(struct IRInstr *instr);
+int isLiveAfter(struct IRBlock *block, struct IRInstr *instr, int reg);
+int instrSize(struct IRInstr *instr);
+void printInstr(struct IRInstr *instr, FILE *out);
+void dumpIR(struct IRProgram *prog, FILE *out);
+void freeIR(struct IRProgram *prog);
+
+#endif
@@ -20,63 +20,181 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static struct Token *next = NULL;
-struct Token *searchForNext(void);
+static struct Token *tokens = NULL;
+static size_t tokenCount = 0;
+static size_t tokenIndex = 0;
+static void searchForNext(struct Token *);
 struct Token *lexRestNumber(struct Token *);
 static struct Token *checkForIdentifier(struct Token *ans);
 static struct Token *handleUnrecognized(int, int);
-static int checkInputAgainstStr(char *, int);
+static void initKeywordDfa();
+
+/*
+ * Keyword DFA. Columns are case-folded letters, then digits and '-'.
+ * kwAccept maps a state to the keyword it spells, or TOKEN_EOF if it spells nothing.
+*/
+#define KW_COL_DIGIT 26
+#define KW_COL_DASH 27
+#define KW_COLS 28
+#define KW_COL_NONE 0xFF
+#define KW_DEAD 0
+#define KW_START 1
+#define KW_MAX_STATES 64
+static unsigned char kwColumn[256];
+static unsigned char kwDfa[KW_MAX_STATES][KW_COLS];
+static enum TokenType kwAccept[KW_MAX_STATES];
 
 size_t inputIndex = 0;
-char *fullInput = NULL;
+const char *fullInput = NULL;
 size_t fullInputSize = 0;
+static int inputIsMapped = 0;
 
-// TODO: calling getchar not necessary if we already have next char buffered
-// though it won't make any performance difference as stdlib is really good with character buffering.
-int getNextChar() {
-	if (fullInput == NULL) {
-		fullInput = calloc(512, sizeof(char));
-		fullInputSize = 512;
-	} else if (inputIndex + 1 >= fullInputSize) {
-		fullInput = realloc(fullInput, fullInputSize * 2);
-		fullInputSize *= 2;
+/*
+ * EFFECTS: makes the entire source available in fullInput as a single immutable buffer.
+ * If path is NULL we read stdin instead. Regular files are mmap'd, anything else
+ * (pipes, terminals, empty files) is slurped in one go.
+*/
+void loadInput(const char *path)
+{
+	int fd = STDIN_FILENO;
+	struct stat st;
+	initKeywordDfa();
+	if (path != NULL && (fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		exit(1);
 	}
-	int ans = getc(stdin);
-	fullInput[inputIndex++] = (char)ans;
-	return ans;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			fullInput = map;
+			fullInputSize = st.st_size;
+			inputIsMapped = 1;
+			if (fd != STDIN_FILENO) close(fd);
+			return;
+		}
+	}
+
+	size_t cap = 4096, len = 0;
+	char *buf = malloc(cap);
+	ssize_t got;
+	while (buf != NULL && (got = read(fd, buf + len, cap - len)) != 0) {
+		if (got < 0) {
+			perror(path ? path : "stdin");
+			exit(1);
+		}
+		len += got;
+		if (len == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+		}
+	}
+	if (buf == NULL) {
+		fputs("Out of memory reading input\n", stderr);
+		exit(1);
+	}
+	fullInput = buf;
+	fullInputSize = len;
+	inputIsMapped = 0;
+	if (fd != STDIN_FILENO) close(fd);
 }
 
-void undoNextChar() {
-	ungetc(fullInput[--inputIndex], stdin);
+/*
+ * EFFECTS: releases the buffer made by loadInput and the tokens made from it.
+ * No tokens may be looked at afterwards.
+*/
+void freeInput()
+{
+	free(tokens);
+	tokens = NULL;
+	tokenCount = tokenIndex = 0;
+	if (inputIsMapped) {
+		munmap((void *)fullInput, fullInputSize);
+	} else {
+		free((void *)fullInput);
+	}
+	fullInput = NULL;
+	fullInputSize = 0;
 }
 
-void freeToken(struct Token *token)
+/*
+ * The cursor always moves, even past the end, so undoNextChar is a plain decrement
+ * no matter what getNextChar gave us.
+*/
+static inline int getNextChar()
 {
-	free(token);
+	if (inputIndex >= fullInputSize) {
+		inputIndex++;
+		return EOF;
+	}
+	return (unsigned char)fullInput[inputIndex++];
+}
+
+static inline void undoNextChar()
+{
+	inputIndex--;
+}
+
+/*
+ * EFFECTS: lexes all of fullInput into one contiguous token array, ending in a TOKEN_EOF.
+ * REQUIRES: loadInput has been called.
+*/
+void tokenize()
+{
+	// roughly one token per 3 chars of source is typical - start there and double if we're wrong
+	size_t cap = fullInputSize / 3 + 16;
+	tokens = malloc(cap * sizeof(*tokens));
+	tokenCount = 0;
+	tokenIndex = 0;
+	inputIndex = 0;
+	do {
+		if (tokenCount == cap) {
+			cap *= 2;
+			tokens = realloc(tokens, cap * sizeof(*tokens));
+		}
+		if (tokens == NULL) {
+			fputs("Out of memory lexing input\n", stderr);
+			exit(1);
+		}
+		searchForNext(&tokens[tokenCount]);
+	} while (tokens[tokenCount++].type != TOKEN_EOF);
 }
 
 int isInfix(enum TokenType type)
 {
-	return PLUS <= type && type <= BITWISE_XOR;
+	// NOT sits among the binary operators in the enum, but is only ever prefix
+	return PLUS <= type && type <= BITWISE_XOR && type != NOT;
 }
 
 struct Token *peek()
 {
-	if (next == NULL) {
-		next = searchForNext();
+	return &tokens[tokenIndex];
+}
+
+/*
+ * EFFECTS: produces the token n places after the next one - peekAhead(0) is peek().
+ * Looking past the end just gives the EOF token.
+*/
+struct Token *peekAhead(size_t n)
+{
+	if (tokenIndex + n >= tokenCount) {
+		return &tokens[tokenCount - 1];
 	}
-	return next;
+	return &tokens[tokenIndex + n];
 }
 
 /*
- * Accepts last token as correct and deletes it.
- * once a token is accepted, it is gone forever - no use after free's, please!
+ * Accepts last token as correct and moves past it.
+ * The EOF token is never moved past, so it can be peeked forever.
 */
 void acceptIt()
 {
-	freeToken(next);
-	next = NULL;
+	if (tokenIndex + 1 < tokenCount) {
+		tokenIndex++;
+	}
 }
 
 /*
@@ -87,39 +205,36 @@ void accept(enum TokenType type)
 {
 	struct Token *next = peek();
 	if (next->type != type) {
-		char *unexpectedTok = malloc(next->end - next->start + 1);
-		strncpy(unexpectedTok, fullInput + next->start, next->end - next->start);
-		unexpectedTok[next->end - next->start] = '\0';
-		fprintf(stderr, "Expected `%s` but got `%s`\n", TokenStrings[type], unexpectedTok);
-		free(unexpectedTok);
+		fprintf(stderr, "Expected `%s` but got `%.*s`\n", TokenStrings[type],
+			(int)(next->end - next->start), fullInput + next->start);
 	}
 	acceptIt();
 }
 
 /*
- * Finds next Token and returns it.
+ * Finds next Token and puts it in ans.
  *
  * There is little to say here. It looks super scary.
  * Writing it doubled the length of my chest hair.
 */
-struct Token *searchForNext()
+static void searchForNext(struct Token *ans)
 {
 	int nextChar;
-	struct Token *ans = malloc(sizeof(struct Token));
 	nextChar = getNextChar();
 	while (nextChar == ' ' || nextChar == '\t') {
 		nextChar = getNextChar();
 	}
 	ans->start = inputIndex - 1;
 	if (nextChar == EOF) {
+		// keep the token inside the buffer so error messages can still print it
 		ans->type = TOKEN_EOF;
-		ans->end = inputIndex;
-		return ans;
+		ans->start = ans->end = fullInputSize;
+		return;
 	}
 	if (nextChar == '\n') {
 		ans->type = LINE_END;
 		ans->end = inputIndex;
-		return ans;
+		return;
 	}
 	switch (nextChar) {
 	case '.':
@@ -133,11 +248,12 @@ struct Token *searchForNext()
 	case '7':
 	case '8':
 	case '9':
-		return lexRestNumber(ans);
+		lexRestNumber(ans);
+		return;
 	case '(':
 		ans->type = LPAR;
 		break;
-		return ans;
+		return;
 	case ')':
 		ans->type = RPAR;
 		break;
@@ -215,10 +331,10 @@ struct Token *searchForNext()
 		break;
 	default:
 		undoNextChar();
-		return checkForIdentifier(ans);
+		checkForIdentifier(ans);
+		return;
 	}
 	ans->end = inputIndex;
-	return ans;
 }
 
 /*
@@ -249,121 +365,75 @@ struct Token *lexRestNumber(struct Token *ans)
  * Searches for any of our string keywords otherwise assumes it's an identifier.
  * speaking of which:
  * Identifier ::=  [A-Za-z] [A-Za-z0-9]*
+ *
+ * The whole word is run through the keyword DFA one character at a time, so we
+ * never look at a character twice. The only exception is non-void: if the DFA
+ * dies somewhere in "-void" we rewind to the '-' and hand back a plain identifier.
 */
 static struct Token *checkForIdentifier(struct Token *ans)
 {
-	int char1;
 	int nextChar = getNextChar();
-	ans->type = -1;
-	switch(nextChar) {
-	case 'a':
-	case 'A':
-		if (checkInputAgainstStr("nd", 1)) {
-			ans->type = AND;
-		}
-		break;
-	case 'c':
-	case 'C':
-		if (checkInputAgainstStr("onst", 1)) {
-			ans->type = CONST;
-		}
-		break;
-	case 'e':
-	case 'E':
-		if (checkInputAgainstStr("lse", 1)) {
-			ans->type = ELSE;
-		}
-		break;
-	case 'f':
-	case 'F':
-		if (checkInputAgainstStr("unc", 1)) {
-			ans->type = FUNC;
-		}
-		break;
-	case 'i':
-	case 'I':
-		if (checkInputAgainstStr("f", 1)) {
-			ans->type = IF;
-		}
-		break;
-	case 'n':
-	case 'N':
-		if (checkInputAgainstStr("on-void", 1)) {
-			ans->type = NON_VOID;
-		}
-		break;
-	case 'o':
-	case 'O':
-		char1 = getNextChar();
-		if (tolower(char1) == 'r') {
-			ans->type = OR;
-		}
-		break;
-	case 'r':
-	case 'R':
-		if (checkInputAgainstStr("eturn", 1)) {
-			ans->type = RETURN;
-		}
-		break;
-	case 'v':
-	case 'V':
-		if (checkInputAgainstStr("ar", 1)) {
-			ans->type = VAR;
-		} else if (checkInputAgainstStr("oid", 1)) {
-			ans->type = VOID;
-		}
-		break;
-	case 'w':
-	case 'W':
-		if (checkInputAgainstStr("hile", 1)) {
-			ans->type = WHILE;
-		}
-		break;
-	}
-	if (ans->type != -1) {
-		ans->end = inputIndex;
-		return ans;
-	}
-	if (!isalpha(nextChar)) {
+	unsigned char col, state;
+	size_t dashIndex = 0;
+	if (nextChar == EOF || kwColumn[nextChar] >= KW_COL_DIGIT) {
 		handleUnrecognized(ans->start, inputIndex);
 	}
-	ans->type = IDENTIFIER;
-	do {
-		nextChar = getNextChar();
-	} while (isalnum(nextChar));
+	state = kwDfa[KW_START][kwColumn[nextChar]];
+	while ((nextChar = getNextChar()) != EOF && (col = kwColumn[nextChar]) != KW_COL_NONE) {
+		if (col == KW_COL_DASH) {
+			if (kwDfa[state][col] == KW_DEAD) break;
+			dashIndex = inputIndex - 1;
+		}
+		state = kwDfa[state][col];
+	}
 	undoNextChar();
+	if (dashIndex != 0 && kwAccept[state] != NON_VOID) {
+		inputIndex = dashIndex;
+		ans->type = IDENTIFIER;
+	} else if (kwAccept[state] != TOKEN_EOF) {
+		ans->type = kwAccept[state];
+	} else {
+		ans->type = IDENTIFIER;
+	}
 	ans->end = inputIndex;
 	return ans;
 }
 
 /*
- * Compares next characters case-insensative to s.
- * if peek = 0: will not unget characters, no matter what.
- * if peek = 1: will unget characters if the comparison fails. 
- * if peek = 2: will unget characters no matter what
- * 
- * I have not entirely decided which form to use, so for now all of these options are available.
- * TODO: replace these constants with a static enum or smthn
+ * EFFECTS: builds kwColumn and the keyword DFA out of the keyword spellings in TokenStrings,
+ * so adding a keyword there (and to keywords below) is all it takes.
  *
- * REQUIRES: len(s) >= 1
+ * State KW_DEAD is "definitely an identifier" and loops on every letter and digit.
+ * It has no '-' transition, which is what stops a word at a dash.
 */
-static int checkInputAgainstStr(char *s, int peek)
+static void initKeywordDfa()
 {
-	int next;
-	size_t i = 0;
+	static const enum TokenType keywords[] = {CONST, VAR, FUNC, VOID, NON_VOID, RETURN, IF, ELSE, WHILE, AND, OR};
+	unsigned char states = KW_START + 1;
+	memset(kwColumn, KW_COL_NONE, sizeof(kwColumn));
+	for (int c = 'a'; c <= 'z'; c++) {
+		kwColumn[c] = kwColumn[toupper(c)] = c - 'a';
+	}
+	for (int c = '0'; c <= '9'; c++) {
+		kwColumn[c] = KW_COL_DIGIT;
+	}
+	kwColumn['-'] = KW_COL_DASH;
 
-	while (i < strlen(s)) {
-		if (tolower((next = getNextChar())) != tolower(s[i++])) {
-			while ((peek >= 1) && i-- > 0) {
-				undoNextChar();
+	memset(kwDfa, KW_DEAD, sizeof(kwDfa));
+	for (size_t i = 0; i < KW_MAX_STATES; i++) {
+		kwAccept[i] = TOKEN_EOF;
+	}
+	for (size_t k = 0; k < sizeof(keywords) / sizeof(*keywords); k++) {
+		unsigned char state = KW_START;
+		for (const char *c = TokenStrings[keywords[k]]; *c; c++) {
+			unsigned char col = kwColumn[(unsigned char)*c];
+			if (kwDfa[state][col] == KW_DEAD) {
+				kwDfa[state][col] = states++;
 			}
-			return 0;
+			state = kwDfa[state][col];
 		}
+		kwAccept[state] = keywords[k];
 	}
-	while ((peek == 2) && i-- > 0) {
-				undoNextChar();
-	}
-	return 1;
 }
 
 /*
@@ -372,9 +442,7 @@ static int checkInputAgainstStr(char *s, int peek)
 static struct Token *handleUnrecognized(int start, int end)
 {
 	// for now
-	char *spelling = calloc(end - start + 1, sizeof(char));
-	getInputSubstr(spelling, start, end);
-	fprintf(stderr, "Unrecognized token: %s\n                    ^\n", spelling);
+	fprintf(stderr, "Unrecognized token: %.*s\n                    ^\n", end - start, fullInput + start);
 	exit(1);
 }
 
@@ -387,12 +455,3 @@ void getInputSubstr(char *dest, size_t startIndex, size_t endIndex)
 	strncpy(dest, fullInput + startIndex, endIndex - startIndex);
 	dest[endIndex - startIndex] = '\0';
 }
-
-/*
- * EFFECTS: produces true if the strings represented by given inputs are the same, and false otherwise.
-*/
-int compareInputSubstr(size_t start1, size_t end1, size_t start2, size_t end2)
-{
-	if (end1 - start1 != end2 - start2) return 0;
-	return strncmp(fullInput + start1, fullInput + start2, end1 - start1) == 0;
-}
\ No newline at end of file
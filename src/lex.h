@@ -97,12 +97,14 @@ struct Token {
 	size_t end;
 };
 
-void freeToken(struct Token *);
+void loadInput(const char *);
+void freeInput(void);
+void tokenize(void);
 int isInfix(enum TokenType);
 struct Token *peek(void);
+struct Token *peekAhead(size_t);
 void acceptIt(void);
 void accept(enum TokenType);
 void getInputSubstr(char *, size_t, size_t);
-int compareInputSubstr(size_t, size_t, size_t, size_t);
 
 #endif
@@ -20,19 +20,96 @@
 #include "AST.h"
 #include "contextualAnalysis.h"
 #include "codegen.h"
+#include "intern.h"
+#include "flatAST.h"
+#include "ir.h"
+#include "branchRelax.h"
+#include "emit.h"
+#include "peephole.h"
+#include "inline.h"
+#include "tailCall.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-int main(void)
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-O2 | -Os] [--dump-ast | --dump-ir] [--peephole-stats] [--inline-threshold=N] [--no-tail-calls] [file]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
 {
 	struct Token *next;
 	struct AST *expr;
+	const char *path = NULL;
+	int dumpAst = 0;
+	int dumpIr = 0;
+	int peepholeStats = 0;
+	int inlineThreshold = INLINE_THRESHOLD;
+	int thresholdGiven = 0;
+	int tailCalls = 1;
+	char *end;
+	enum OptLevel optLevel = OPT_DEFAULT;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--dump-ast") == 0) {
+			dumpAst = 1;
+		} else if (strcmp(argv[i], "--dump-ir") == 0) {
+			dumpIr = 1;
+		} else if (strcmp(argv[i], "--peephole-stats") == 0) {
+			peepholeStats = 1;
+		} else if (strncmp(argv[i], "--inline-threshold=", 19) == 0) {
+			inlineThreshold = strtol(argv[i] + 19, &end, 10);
+			if (end == argv[i] + 19 || *end != '\0') usage(argv[0]);
+			thresholdGiven = 1;
+		} else if (strcmp(argv[i], "--no-tail-calls") == 0) {
+			tailCalls = 0;
+		} else if (strcmp(argv[i], "-O2") == 0) {
+			optLevel = OPT_SPEED;
+		} else if (strcmp(argv[i], "-Os") == 0) {
+			optLevel = OPT_SIZE;
+		} else if (argv[i][0] != '-' && path == NULL) {
+			path = argv[i];
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (!thresholdGiven && optLevel == OPT_SIZE) {
+		// only inline what doesn't make the code any bigger
+		inlineThreshold = 0;
+	} else if (!thresholdGiven && optLevel == OPT_SPEED) {
+		inlineThreshold = 2*INLINE_THRESHOLD;
+	}
+	loadInput(path);
+	tokenize();
 	while ((next = peek())->type != TOKEN_EOF) {
 		fflush(stdout);
 		expr = analyze(parse());
-		generateCode(expr);
-		//printTree(expr);
+		inlineFunctions(expr, inlineThreshold);
+		if (tailCalls) {
+			eliminateTailCalls(expr);
+		}
+		if (dumpAst) {
+			printFlatTree(flattenTree(expr));
+		} else {
+			struct IRProgram *ir = generateCode(expr, optLevel);
+			peephole(ir);
+			if (dumpIr) {
+				dumpIR(ir, stdout);
+			} else {
+				relaxBranches(ir);
+				emitAssembly(ir, stdout);
+			}
+			freeIR(ir);
+		}
 		freeTree(expr);
 		putchar('\n');
 	}
+	if (peepholeStats) {
+		printPeepholeStats(stderr);
+	}
+	freeTreeArena();
+	freeSymbols();
+	freeInput();
+	return 0;
 }
@@ -23,14 +23,13 @@
 #include "lex.h"
 #include "parse.h"
 #include "AST.h"
+#include "intern.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 
-#define MAX_P 10
-
-extern char *fullInput;
+extern const char *fullInput;
 
 static struct ASTLinkedNode *foldExpr(struct ASTLinkedNode *left, enum TokenType type, struct ASTLinkedNode *right);
 static struct ASTLinkedNode *parseProgram();
@@ -46,61 +45,12 @@ static struct ASTLinkedNode *parseConstDecl();
 static struct ASTLinkedNode *parseVarDecl();
 static struct ASTLinkedNode *parseIdentifierCommand();
 static struct ASTLinkedNode *parseIndirectAssignment();
-static struct ASTLinkedNode *parsePriority(int);
+static struct ASTLinkedNode *parseBinary(int);
 static struct ASTLinkedNode *parseExpr();
 static struct ASTLinkedNode *parsePrimaryExpr();
 static struct ASTLinkedNode *handleIdentifier();
-static int isPriority(enum TokenType type, int priority);
 static struct ASTLinkedNode *handleUnexpectedToken(struct Token *tok);
 
-/*
- * We will need this for precomputation later!
- * 
-int fold(int left, enum TokenType type, int right)
-{
-	switch (type) {
-	case PLUS:
-		return left + right;
-	case MINUS:
-		return left - right;
-	case TIMES:
-		return left * right;
-	case DIVIDE:
-		return left / right;
-	case MODULO:
-		return left % right;
-	case LEFT_SHIFT:
-		return left << right;
-	case RIGHT_SHIFT:
-		return left >> right;
-	case LESS_THAN:
-		return left < right;
-	case LESS_THAN_EQUALS:
-		return left <= right;
-	case GREATER_THAN:
-		return left > right;
-	case GREATER_THAN_EQUALS:
-		return left >= right;
-	case EQUALS:
-		return left == right;
-	case NOT_EQUALS:
-		return left != right;
-	case OR:
-		return left || right;
-	case AND:
-		return left && right;
-	case BITWISE_AND:
-		return left & right;
-	case BITWISE_OR:
-		return left | right;
-	case BITWISE_XOR:
-		return left ^ right;
-	default:
-		fprintf(stderr, "idk how to fold in %s\n", TokenStrings[type]);
-		return left;
-	}
-}*/
-
 /*
  * Takes two expressions and an operator and combines them into one operation appropriately.
 */
@@ -122,7 +72,7 @@ static struct ASTLinkedNode *foldExpr(struct ASTLinkedNode *left, enum TokenType
 struct AST *parse()
 {
 	struct ASTLinkedNode *head = parseProgram();
-	struct AST *ans = malloc(sizeof(*ans));
+	struct AST *ans = treeAlloc(sizeof(*ans));
 	ans->root = head;
 	return ans;
 }
@@ -272,6 +222,7 @@ static struct ASTLinkedNode *parseFunctionDecl()
 	ans->val.startIndex = next->start;
 	ans->val.endIndex = next->end;
 	ans->val.children = handleIdentifier();
+	ans->val.symbol = ans->val.children->val.symbol;
 	ans->val.children->next = parseParamList();
 	ans->val.children->next->next = parseSingleCommand();
 	return ans;
@@ -374,6 +325,7 @@ static struct ASTLinkedNode *parseConstDecl()
 
 	accept(CONST);
 	ans->val.children = handleIdentifier();
+	ans->val.symbol = ans->val.children->val.symbol;
 	accept(ASSIGN);
 	struct ASTLinkedNode *expr = parseExpr();
 	accept(LINE_END);
@@ -390,6 +342,7 @@ static struct ASTLinkedNode *parseVarDecl()
 	struct ASTLinkedNode *ans = newLinkedAstNode(VAR_DECL);
 	accept(VAR);
 	ans->val.children = handleIdentifier();
+	ans->val.symbol = ans->val.children->val.symbol;
 	struct Token *next = peek();
 	if (next->type != LINE_END) {
 		accept(ASSIGN);
@@ -404,21 +357,22 @@ static struct ASTLinkedNode *parseVarDecl()
  * directAssignment ::= Identifier '=' Expr EOL
  * or
  * functionCall ::= Identifier ArgList EOL
- * together, these are not LL(1), so we need to break it up
+ * together, these are LL(2) - the token after the identifier tells us which one we have.
 */
 static struct ASTLinkedNode *parseIdentifierCommand()
 {
-	struct ASTLinkedNode *child, *ans = newLinkedAstNode(DIRECT_ASSIGN);
-	child = handleIdentifier();
-	ans->val.children = child;
-
-	struct Token *next = peek();
-	if (next->type == LPAR) {
-		ans->val.type = FUNC_CALL;
+	struct ASTLinkedNode *child, *ans;
+	if (peekAhead(1)->type == LPAR) {
+		ans = newLinkedAstNode(FUNC_CALL);
+		child = handleIdentifier();
+		ans->val.children = child;
 		child->next = parseArgList();
 		accept(LINE_END);
 		return ans;
 	}
+	ans = newLinkedAstNode(DIRECT_ASSIGN);
+	child = handleIdentifier();
+	ans->val.children = child;
 	accept(ASSIGN);
 	child->next = parseExpr();
 	accept(LINE_END);
@@ -440,29 +394,45 @@ static struct ASTLinkedNode *parseIndirectAssignment()
 }
 
 /*
- * parsePriority does the actual expr parsing - small priority means "priority one" - done first.
- * Big priority done last.
+ * How tightly each infix operator binds - big binds tight, 0 means "not an infix operator".
+ * This is the whole precedence table:
+ *   or < and < | < ^ < & < (== !=) < (< <= > >=) < (<< >>) < (+ -) < (* / %)
 */
+static const unsigned char bindingPower[] = {
+	[OR] = 1,
+	[AND] = 2,
+	[BITWISE_OR] = 3,
+	[BITWISE_XOR] = 4,
+	[BITWISE_AND] = 5,
+	[EQUALS] = 6, [NOT_EQUALS] = 6,
+	[LESS_THAN] = 7, [LESS_THAN_EQUALS] = 7, [GREATER_THAN] = 7, [GREATER_THAN_EQUALS] = 7,
+	[LEFT_SHIFT] = 8, [RIGHT_SHIFT] = 8,
+	[PLUS] = 9, [MINUS] = 9,
+	[TIMES] = 10, [DIVIDE] = 10, [MODULO] = 10,
+	[LINE_END] = 0 // makes the table big enough for any token to index it
+};
+
 struct ASTLinkedNode *parseExpr()
 {
-	return parsePriority(MAX_P);
+	return parseBinary(0);
 }
 
 /*
- * Expr(p) ::= Expr(p - 1) (Operator(p) Expr(p - 1))*
+ * Expr(p) ::= primaryExpr (Operator(q) Expr(q))*    for every q > p
+ *
+ * Precedence climbing: one loop handles every operator that binds tighter than p. Operators of
+ * the same power stop the right hand side, which is what makes everything left associative.
 */
-static struct ASTLinkedNode *parsePriority(int priority)
+static struct ASTLinkedNode *parseBinary(int minPower)
 {
-	if (priority <= 0) {
-		return parsePrimaryExpr();
-	}
-	struct ASTLinkedNode *right, *left = parsePriority(priority - 1);
+	struct ASTLinkedNode *right, *left = parsePrimaryExpr();
 	struct Token *next = peek();
+	int power;
 
-	while (isPriority(next->type, priority)) {
+	while ((power = bindingPower[next->type]) > minPower) {
 		enum TokenType operationType = next->type;
 		acceptIt();
-		right = parsePriority(priority - 1);
+		right = parseBinary(power);
 		left = foldExpr(left, operationType, right);
 		next = peek();
 	}
@@ -481,14 +451,12 @@ static struct ASTLinkedNode *parsePrimaryExpr()
 	char *spelling;
 	switch (next->type) {
 	case NUMBER:
-		spelling = calloc(next->end - next->start + 1, sizeof(char));
-		strncpy(spelling, fullInput + next->start, next->end - next->start);
-		spelling[next->end - next->start] = '\0';
+		spelling = treeAlloc(next->end - next->start + 1);
+		getInputSubstr(spelling, next->start, next->end);
 		int base = (spelling[1] == 'x') ? 16 : ((spelling[0] == '0') ? 8 : 10);
 		ans = newLinkedAstNode(NUMBER_LITERAL);
 		ans->val.val = strtol(spelling, NULL, base);
 		ans->val.isConstant = 1;
-		free(spelling);
 		acceptIt();
 		return ans;
 	case IDENTIFIER:
@@ -540,52 +508,14 @@ static struct ASTLinkedNode *handleIdentifier()
 	struct ASTLinkedNode *ans = newLinkedAstNode(IDENT_REF);
 	ans->val.startIndex = next->start;
 	ans->val.endIndex = next->end;
+	ans->val.symbol = internInputSubstr(next->start, next->end);
 	accept(IDENTIFIER);
 	return ans;
 }
 
-/*
- * small priority is done *first*! think "first priority". big priority *last*!
- * we work up this table from bottom to top when evaluating expressions.
-*/
-int isPriority(enum TokenType type, int priority)
-{
-	if (!isInfix(type)) {
-		return 0;
-	}
-	switch (priority) {
-	case 10:
-		return type == OR;
-	case 9:
-		return type == AND;
-	case 8:
-		return type == BITWISE_OR;
-	case 7:
-		return type == BITWISE_XOR;
-	case 6:
-		return type == BITWISE_AND;
-	case 5:
-		return type == EQUALS || type == NOT_EQUALS;
-	case 4:
-		return type == LESS_THAN || type == LESS_THAN_EQUALS || type == GREATER_THAN || type == GREATER_THAN_EQUALS;
-	case 3:
-		return type == LEFT_SHIFT || type == RIGHT_SHIFT;
-	case 2:
-		return type == PLUS || type == MINUS;
-	case 1:
-		return type == TIMES || type == DIVIDE || type == MODULO;
-	default:
-		return 0;
-	}
-}
-
 static struct ASTLinkedNode *handleUnexpectedToken(struct Token *tok)
 {
-	// TODO: lexer function to turn start, end into string.
-	char *unexpectedTok = malloc(tok->end - tok->start + 1);
-	getInputSubstr(unexpectedTok, tok->start, tok->end);
-	fprintf(stderr, "Unexpected: `%s`\n", unexpectedTok);
-	free(unexpectedTok);
+	fprintf(stderr, "Unexpected: `%.*s`\n", (int)(tok->end - tok->start), fullInput + tok->start);
 
 	exit(1);
 }
\ No newline at end of file
@@ -0,0 +1,625 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ *
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The peephole optimizer. Codegen works one node at a time, so what it emits is full of little
+ * redundancies at the seams: a store straight followed by a load of the same word, a push
+ * popped right back off, a constant loaded just to be added. Each rule in the table below
+ * matches a short window of instructions inside a block and says what to put there instead.
+ * Every rule is tried at every instruction until none of them match anywhere.
+ *
+ * In a pattern, A to D stand for registers, distinct letters for distinct registers, but never
+ * the stack pointer r5, which has to be spelled out. N and M stand for numbers (or a label's
+ * address, for ld $N), and L for a label. -N in a replacement is the negation of what N
+ * matched. Anything else has to match exactly. Conditions on a rule are
+ *   dead X    what ends up in X isn't read after the window, so the rewrite needn't set it
+ *   next L    L labels the block right after this one
+*/
+#include "peephole.h"
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_WINDOW 4
+#define REG_VARS 4
+#define NUM_VARS 2
+
+static const char *opNames[] = {
+    [IR_LD_IMM] = "ld", [IR_LD] = "ld", [IR_LD_IDX] = "ld", [IR_ST] = "st", [IR_ST_IDX] = "st",
+    [IR_MOV] = "mov", [IR_ADD] = "add", [IR_AND] = "and", [IR_INC] = "inc", [IR_INCA] = "inca",
+    [IR_DEC] = "dec", [IR_DECA] = "deca", [IR_NOT] = "not", [IR_SHL] = "shl", [IR_SHR] = "shr",
+    [IR_GPC] = "gpc", [IR_BR] = "br", [IR_BEQ] = "beq", [IR_BGT] = "bgt", [IR_J] = "j"
+};
+
+/*
+ * One operand of a pattern instruction. Registers, numbers and labels each have their own
+ * variables, which bind on their first match in the window.
+*/
+enum OperandKind {
+    OPND_NONE,
+    OPND_REG,       // a particular register
+    OPND_REG_VAR,
+    OPND_NUM,       // a particular number
+    OPND_NUM_VAR,
+    OPND_NEG_NUM_VAR,
+    OPND_LABEL_VAR
+};
+
+struct Operand {
+    enum OperandKind kind;
+    long value; // the register, number, or which variable
+};
+
+struct PatternInstr {
+    enum IROpcode op;
+    struct Operand src, dst, base, index, imm, label;
+};
+
+struct Pattern {
+    int len;
+    struct PatternInstr instrs[MAX_WINDOW];
+};
+
+struct PeepholeRule {
+    const char *name;
+    const char *match;    // instructions separated by " / "
+    const char *replace;  // "" to delete the window
+    const char *when;     // conditions, separated by " / ", or NULL
+};
+
+/*
+ * A rule, read into something that can be matched against the IR
+*/
+struct CompiledRule {
+    const struct PeepholeRule *rule;
+    struct Pattern match, replace;
+    int deadRegs;  // bit i set for register variable i under dead
+    int nextLabel; // whether the rule has next L
+    int hits;
+};
+
+static const struct PeepholeRule rules[] = {
+    // a value stored and read straight back
+    {"store then load", "st A, N(B) / ld N(B), A", "st A, N(B)", NULL},
+    {"store then load elsewhere", "st A, N(B) / ld N(B), C", "st A, N(B) / mov A, C", NULL},
+    {"store then load into base", "st A, N(B) / ld N(B), B", "st A, N(B) / mov A, B", NULL},
+    {"store then load on the stack", "st A, N(r5) / ld N(r5), A", "st A, N(r5)", NULL},
+    {"store then load elsewhere on the stack", "st A, N(r5) / ld N(r5), B", "st A, N(r5) / mov A, B", NULL},
+    {"store then load indexed", "st A, (B, C, 4) / ld (B, C, 4), D", "st A, (B, C, 4) / mov A, D", NULL},
+    // pushes popped right back off
+    {"push then pop", "deca r5 / st A, (r5) / ld (r5), A / inca r5", "", NULL},
+    {"push then pop elsewhere", "deca r5 / st A, (r5) / ld (r5), B / inca r5", "mov A, B", NULL},
+    {"pop then push", "inca r5 / deca r5", "", NULL},
+    {"push nothing", "deca r5 / inca r5", "", NULL},
+    {"grow then shrink", "deca A / inca A", "", NULL},
+    {"shrink then grow", "inca A / deca A", "", NULL},
+    {"inc then dec", "inc A / dec A", "", NULL},
+    {"dec then inc", "dec A / inc A", "", NULL},
+    {"double not", "not A / not A", "", NULL},
+    // constants that only get added in
+    {"negate constant", "ld $N, A / not A / inc A", "ld $-N, A", NULL},
+    {"add zero", "ld $0, A / add A, B", "", "dead A"},
+    {"add one", "ld $1, A / add A, B", "inc B", "dead A"},
+    {"add minus one", "ld $-1, A / add A, B", "dec B", "dead A"},
+    {"add four", "ld $4, A / add A, B", "inca B", "dead A"},
+    {"add minus four", "ld $-4, A / add A, B", "deca B", "dead A"},
+    {"add two", "ld $2, A / add A, B", "inc B / inc B", "dead A"},
+    {"add minus two", "ld $-2, A / add A, B", "dec B / dec B", "dead A"},
+    {"add eight", "ld $8, A / add A, B", "inca B / inca B", "dead A"},
+    {"add minus eight", "ld $-8, A / add A, B", "deca B / deca B", "dead A"},
+    // copies that needn't be made
+    {"self move", "mov A, A", "", NULL},
+    {"move back", "mov A, B / mov B, A", "mov A, B", NULL},
+    {"constant then move", "ld $N, A / mov A, B", "ld $N, B", "dead A"},
+    {"load then move", "ld N(C), A / mov A, B", "ld N(C), B", "dead A"},
+    {"indexed load then move", "ld (C, D, 4), A / mov A, B", "ld (C, D, 4), B", "dead A"},
+    {"move then move", "mov A, B / mov B, C", "mov A, C", "dead B"},
+    {"move then add", "mov A, B / add B, C", "add A, C", "dead B"},
+    {"move then and", "mov A, B / and B, C", "and A, C", "dead B"},
+    {"move then store", "mov A, B / st B, N(C)", "st A, N(C)", "dead B"},
+    {"move then store to", "mov A, B / st C, N(B)", "st C, N(A)", "dead B"},
+    {"move then load from", "mov A, B / ld N(B), C", "ld N(A), C", "dead B"},
+    {"move then beq", "mov A, B / beq B, L", "beq A, L", "dead B"},
+    {"move then bgt", "mov A, B / bgt B, L", "bgt A, L", "dead B"},
+    // jumps to where control goes anyway
+    {"br to next", "br L", "", "next L"},
+    {"j to next", "j L", "", "next L"},
+    {"beq to next", "beq A, L", "", "next L"},
+    {"bgt to next", "bgt A, L", "", "next L"}
+};
+
+#define RULE_COUNT (sizeof(rules) / sizeof(rules[0]))
+
+static struct CompiledRule compiled[RULE_COUNT];
+
+static int deadWrites = 0;
+static int rulesParsed = 0;
+
+/*
+ * What a window's variables matched
+*/
+struct Bindings {
+    int regs[REG_VARS];
+    int numBound[NUM_VARS];
+    long nums[NUM_VARS];
+    int numSymbols[NUM_VARS];
+    int label;
+};
+
+static struct IRProgram *prog;
+
+static void parseRules(void);
+static void parsePattern(struct CompiledRule *rule, const char *text, struct Pattern *pattern);
+static void parsePatternInstr(struct CompiledRule *rule, char *text, struct PatternInstr *instr);
+static struct Operand parseOperand(struct CompiledRule *rule, const char *text);
+static void parseMemOperand(struct CompiledRule *rule, char *text, struct PatternInstr *instr);
+static void parseConditions(struct CompiledRule *rule);
+static void badRule(struct CompiledRule *rule, const char *why);
+static int applyRule(struct CompiledRule *rule, struct IRBlock *block, struct IRInstr *at);
+static int matchInstr(struct PatternInstr *pat, struct IRInstr *instr, struct Bindings *b);
+static int matchReg(struct Operand *pat, int reg, struct Bindings *b);
+static int matchNum(struct Operand *pat, long imm, int symbol, struct Bindings *b);
+static struct IRInstr *buildInstr(struct PatternInstr *pat, struct Bindings *b);
+static int removeDeadWrite(struct IRBlock *block, struct IRInstr *instr);
+static int writesOnly(struct IRInstr *instr);
+static void removeInstr(struct IRBlock *block, struct IRInstr *instr);
+
+/*
+ * MODIFIES: prog
+ * EFFECTS: rewrites prog with the peephole rules (and throws out writes to registers that are
+ *   never read) until none apply any more.
+*/
+void peephole(struct IRProgram *program)
+{
+    prog = program;
+    if (!rulesParsed) {
+        parseRules();
+        rulesParsed = 1;
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        computeCFG(prog);
+        computeLiveness(prog);
+        for (struct IRBlock *b = prog->blocks; b != NULL; b = b->next) {
+            if (b->fn == NULL) continue;
+            struct IRInstr *i = b->first;
+            while (i != NULL) {
+                struct IRInstr *prev = i->prev;
+                int applied = removeDeadWrite(b, i);
+                for (size_t r = 0; r < RULE_COUNT && !applied; r++) {
+                    applied = applyRule(&compiled[r], b, i);
+                }
+                if (!applied) {
+                    i = i->next;
+                    continue;
+                }
+                // a rewrite can make a new match start a little earlier
+                changed = 1;
+                i = prev != NULL ? prev : b->first;
+            }
+        }
+    }
+    computeCFG(prog);
+}
+
+/*
+ * EFFECTS: writes how many times each rule has fired so far to out
+*/
+void printPeepholeStats(FILE *out)
+{
+    fputs("peephole rule hits:\n", out);
+    fprintf(out, "%8d  dead register write\n", deadWrites);
+    for (size_t r = 0; r < RULE_COUNT; r++) {
+        fprintf(out, "%8d  %s\n", compiled[r].hits, rules[r].name);
+    }
+}
+
+/*
+ * EFFECTS: if the window starting at `at` in block matches rule, replaces it and produces 1
+*/
+static int applyRule(struct CompiledRule *rule, struct IRBlock *block, struct IRInstr *at)
+{
+    struct Bindings b;
+    struct IRInstr *window[MAX_WINDOW];
+    for (int v = 0; v < REG_VARS; v++) b.regs[v] = -1;
+    for (int v = 0; v < NUM_VARS; v++) b.numBound[v] = 0;
+    b.label = -1;
+
+    struct IRInstr *instr = at;
+    for (int k = 0; k < rule->match.len; k++, instr = instr->next) {
+        if (instr == NULL || !matchInstr(&rule->match.instrs[k], instr, &b)) return 0;
+        window[k] = instr;
+    }
+    struct IRInstr *last = window[rule->match.len - 1];
+    for (int v = 0; v < REG_VARS; v++) {
+        if ((rule->deadRegs >> v & 1) && isLiveAfter(block, last, b.regs[v])) return 0;
+    }
+    if (rule->nextLabel) {
+        struct IRBlock *next = block->next;
+        int found = 0;
+        if (last != block->last || next == NULL) return 0;
+        for (int l = 0; next != NULL && l < next->labelCount; l++) {
+            found |= next->labels[l] == b.label;
+        }
+        if (!found) return 0;
+    }
+
+    // a negated number has to be a plain number
+    for (int k = 0; k < rule->replace.len; k++) {
+        struct Operand *imm = &rule->replace.instrs[k].imm;
+        if (imm->kind == OPND_NEG_NUM_VAR && b.numSymbols[imm->value] >= 0) return 0;
+    }
+
+    struct IRInstr *after = last->next;
+    for (int k = 0; k < rule->match.len; k++) {
+        removeInstr(block, window[k]);
+    }
+    for (int k = 0; k < rule->replace.len; k++) {
+        struct IRInstr *fresh = buildInstr(&rule->replace.instrs[k], &b);
+        if (k == 0) fresh->comment = window[0]->comment;
+        fresh->next = after;
+        fresh->prev = after != NULL ? after->prev : block->last;
+        if (fresh->prev != NULL) fresh->prev->next = fresh;
+        else block->first = fresh;
+        if (after != NULL) after->prev = fresh;
+        else block->last = fresh;
+    }
+    rule->hits++;
+    return 1;
+}
+
+static int matchInstr(struct PatternInstr *pat, struct IRInstr *instr, struct Bindings *b)
+{
+    if (pat->op != instr->op) return 0;
+    if (!matchReg(&pat->src, instr->src, b) || !matchReg(&pat->dst, instr->dst, b)
+            || !matchReg(&pat->base, instr->base, b) || !matchReg(&pat->index, instr->index, b)) {
+        return 0;
+    }
+    if (pat->label.kind == OPND_LABEL_VAR) {
+        b->label = instr->symbol;
+        return 1;
+    }
+    if (pat->imm.kind == OPND_NONE) return 1;
+    return matchNum(&pat->imm, instr->imm, instr->symbol, b);
+}
+
+static int matchReg(struct Operand *pat, int reg, struct Bindings *b)
+{
+    switch (pat->kind) {
+    case OPND_NONE:
+        return 1;
+    case OPND_REG:
+        return reg == pat->value;
+    case OPND_REG_VAR:
+        if (reg == SP_REG) return 0;
+        if (b->regs[pat->value] >= 0) return b->regs[pat->value] == reg;
+        for (int v = 0; v < REG_VARS; v++) {
+            if (b->regs[v] == reg) return 0;
+        }
+        b->regs[pat->value] = reg;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int matchNum(struct Operand *pat, long imm, int symbol, struct Bindings *b)
+{
+    if (pat->kind == OPND_NUM) return symbol < 0 && imm == pat->value;
+    if (b->numBound[pat->value]) {
+        return b->nums[pat->value] == imm && b->numSymbols[pat->value] == symbol;
+    }
+    b->numBound[pat->value] = 1;
+    b->nums[pat->value] = imm;
+    b->numSymbols[pat->value] = symbol;
+    return 1;
+}
+
+/*
+ * EFFECTS: produces the instruction pat describes with b's values filled in
+*/
+static struct IRInstr *buildInstr(struct PatternInstr *pat, struct Bindings *b)
+{
+    struct IRInstr *instr = arenaAlloc(&prog->arena, sizeof(*instr));
+    struct Operand *regs[] = {&pat->src, &pat->dst, &pat->base, &pat->index};
+    int *fields[] = {&instr->src, &instr->dst, &instr->base, &instr->index};
+    instr->op = pat->op;
+    for (int f = 0; f < 4; f++) {
+        if (regs[f]->kind == OPND_REG) *fields[f] = regs[f]->value;
+        else if (regs[f]->kind == OPND_REG_VAR) *fields[f] = b->regs[regs[f]->value];
+        else *fields[f] = -1;
+    }
+    instr->imm = 0;
+    instr->symbol = -1;
+    switch (pat->imm.kind) {
+    case OPND_NUM:
+        instr->imm = pat->imm.value;
+        break;
+    case OPND_NUM_VAR:
+        instr->imm = b->nums[pat->imm.value];
+        instr->symbol = b->numSymbols[pat->imm.value];
+        break;
+    case OPND_NEG_NUM_VAR:
+        instr->imm = (long)(int)(0u - (unsigned)b->nums[pat->imm.value]);
+        break;
+    default:
+        break;
+    }
+    if (pat->label.kind == OPND_LABEL_VAR) instr->symbol = b->label;
+    instr->comment = NULL;
+    instr->isLong = 0;
+    instr->prev = instr->next = NULL;
+    return instr;
+}
+
+/*
+ * EFFECTS: if instr does nothing but write a register that is never read, removes it and
+ *   produces 1
+*/
+static int removeDeadWrite(struct IRBlock *block, struct IRInstr *instr)
+{
+    if (!writesOnly(instr) || isLiveAfter(block, instr, instr->dst)) return 0;
+    removeInstr(block, instr);
+    deadWrites++;
+    return 1;
+}
+
+/*
+ * EFFECTS: returns whether the only thing instr does is set its dst register
+*/
+static int writesOnly(struct IRInstr *instr)
+{
+    switch (instr->op) {
+    case IR_LD_IMM:
+    case IR_LD:
+    case IR_LD_IDX:
+    case IR_MOV:
+    case IR_ADD:
+    case IR_AND:
+    case IR_INC:
+    case IR_INCA:
+    case IR_DEC:
+    case IR_DECA:
+    case IR_NOT:
+    case IR_SHL:
+    case IR_SHR:
+    case IR_GPC:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void removeInstr(struct IRBlock *block, struct IRInstr *instr)
+{
+    if (instr->prev != NULL) instr->prev->next = instr->next;
+    else block->first = instr->next;
+    if (instr->next != NULL) instr->next->prev = instr->prev;
+    else block->last = instr->prev;
+}
+
+/*
+ * EFFECTS: turns every rule's text into patterns, or exits if one doesn't make sense
+*/
+static void parseRules()
+{
+    for (size_t r = 0; r < RULE_COUNT; r++) {
+        struct CompiledRule *rule = &compiled[r];
+        rule->rule = &rules[r];
+        rule->hits = 0;
+        parsePattern(rule, rules[r].match, &rule->match);
+        parsePattern(rule, rules[r].replace, &rule->replace);
+        if (rule->match.len == 0) badRule(rule, "nothing to match");
+        parseConditions(rule);
+        for (int k = 0; k < rule->replace.len; k++) {
+            if (rule->replace.instrs[k].imm.kind == OPND_NEG_NUM_VAR && rule->replace.instrs[k].op != IR_LD_IMM) {
+                badRule(rule, "-N outside of ld $-N");
+            }
+        }
+    }
+}
+
+static void parsePattern(struct CompiledRule *rule, const char *text, struct Pattern *pattern)
+{
+    char buf[128];
+    if (strlen(text) >= sizeof(buf)) badRule(rule, "too long");
+    strcpy(buf, text);
+    pattern->len = 0;
+    char *instr = buf;
+    while (*instr != '\0') {
+        char *end = strstr(instr, " / ");
+        if (end != NULL) *end = '\0';
+        if (pattern->len == MAX_WINDOW) badRule(rule, "too many instructions");
+        parsePatternInstr(rule, instr, &pattern->instrs[pattern->len++]);
+        if (end == NULL) break;
+        instr = end + 3;
+    }
+}
+
+/*
+ * EFFECTS: reads one instruction of a pattern, in the same syntax as the assembly
+*/
+static void parsePatternInstr(struct CompiledRule *rule, char *text, struct PatternInstr *instr)
+{
+    struct Operand none = {OPND_NONE, 0};
+    instr->src = instr->dst = instr->base = instr->index = instr->imm = instr->label = none;
+
+    char *name = text;
+    while (*text != '\0' && *text != ' ') text++;
+    if (*text != '\0') *text++ = '\0';
+    char *ops[2] = {NULL, NULL};
+    int n = 0, depth = 0;
+    char *start = text;
+    for (char *p = text;; p++) {
+        if (*p == '(') depth++;
+        if (*p == ')') depth--;
+        if (*p != '\0' && (depth != 0 || *p != ',')) continue;
+        while (*start == ' ') start++;
+        if (*start != '\0' || *p == ',') {
+            if (n == 2) badRule(rule, "too many operands");
+            ops[n++] = start;
+        }
+        if (*p == '\0') break;
+        *p = '\0';
+        start = p + 1;
+    }
+
+    size_t op;
+    for (op = 0; op < sizeof(opNames) / sizeof(opNames[0]); op++) {
+        if (opNames[op] != NULL && strcmp(name, opNames[op]) == 0) break;
+    }
+    if (op == sizeof(opNames) / sizeof(opNames[0])) badRule(rule, "unknown instruction");
+    instr->op = op;
+
+    switch (instr->op) {
+    case IR_LD_IMM:
+    case IR_LD:
+    case IR_LD_IDX:
+        if (n != 2) badRule(rule, "ld takes two operands");
+        instr->dst = parseOperand(rule, ops[1]);
+        if (ops[0][0] == '$') {
+            instr->op = IR_LD_IMM;
+            instr->imm = parseOperand(rule, ops[0] + 1);
+        } else {
+            instr->op = IR_LD;
+            parseMemOperand(rule, ops[0], instr);
+        }
+        break;
+    case IR_ST:
+    case IR_ST_IDX:
+        if (n != 2) badRule(rule, "st takes two operands");
+        instr->op = IR_ST;
+        instr->src = parseOperand(rule, ops[0]);
+        parseMemOperand(rule, ops[1], instr);
+        break;
+    case IR_MOV:
+    case IR_ADD:
+    case IR_AND:
+        if (n != 2) badRule(rule, "expected two registers");
+        instr->src = parseOperand(rule, ops[0]);
+        instr->dst = parseOperand(rule, ops[1]);
+        break;
+    case IR_SHL:
+    case IR_SHR:
+    case IR_GPC:
+        if (n != 2 || ops[0][0] != '$') badRule(rule, "expected a number and a register");
+        instr->imm = parseOperand(rule, ops[0] + 1);
+        instr->dst = parseOperand(rule, ops[1]);
+        break;
+    case IR_BEQ:
+    case IR_BGT:
+        if (n != 2) badRule(rule, "expected a register and a label");
+        instr->src = parseOperand(rule, ops[0]);
+        instr->label = parseOperand(rule, ops[1]);
+        break;
+    case IR_BR:
+    case IR_J:
+        if (n != 1) badRule(rule, "expected a label");
+        instr->label = parseOperand(rule, ops[0]);
+        break;
+    default:
+        if (n != 1) badRule(rule, "expected a register");
+        instr->dst = parseOperand(rule, ops[0]);
+        break;
+    }
+    if (instr->label.kind != OPND_NONE && instr->label.kind != OPND_LABEL_VAR) {
+        badRule(rule, "branches go to L");
+    }
+}
+
+static struct Operand parseOperand(struct CompiledRule *rule, const char *text)
+{
+    struct Operand o = {OPND_NONE, 0};
+    char *end;
+    if (text[0] >= 'A' && text[0] < 'A' + REG_VARS && text[1] == '\0') {
+        o.kind = OPND_REG_VAR;
+        o.value = text[0] - 'A';
+    } else if (text[0] == 'r' && text[1] >= '0' && text[1] <= '7' && text[2] == '\0') {
+        o.kind = OPND_REG;
+        o.value = text[1] - '0';
+    } else if ((text[0] == 'N' || text[0] == 'M') && text[1] == '\0') {
+        o.kind = OPND_NUM_VAR;
+        o.value = text[0] == 'N' ? 0 : 1;
+    } else if (text[0] == '-' && (text[1] == 'N' || text[1] == 'M') && text[2] == '\0') {
+        o.kind = OPND_NEG_NUM_VAR;
+        o.value = text[1] == 'N' ? 0 : 1;
+    } else if (text[0] == 'L' && text[1] == '\0') {
+        o.kind = OPND_LABEL_VAR;
+    } else if ((o.value = strtol(text, &end, 0), end != text && *end == '\0')) {
+        o.kind = OPND_NUM;
+    } else {
+        badRule(rule, "bad operand");
+    }
+    return o;
+}
+
+/*
+ * EFFECTS: reads N(B), (B) or (B, C, 4) into instr, making it the indexed kind for the last
+*/
+static void parseMemOperand(struct CompiledRule *rule, char *text, struct PatternInstr *instr)
+{
+    char *open = strchr(text, '('), *close = strrchr(text, ')');
+    if (open == NULL || close == NULL || close[1] != '\0') badRule(rule, "bad memory operand");
+    *open = *close = '\0';
+    if (open != text) instr->imm = parseOperand(rule, text);
+    else instr->imm = (struct Operand){OPND_NUM, 0};
+
+    char *comma = strchr(open + 1, ',');
+    if (comma == NULL) {
+        instr->base = parseOperand(rule, open + 1);
+        return;
+    }
+    *comma = '\0';
+    char *index = comma + 1;
+    while (*index == ' ') index++;
+    char *scale = strchr(index, ',');
+    if (scale == NULL || open != text) badRule(rule, "bad indexed operand");
+    *scale = '\0';
+    instr->base = parseOperand(rule, open + 1);
+    instr->index = parseOperand(rule, index);
+    instr->imm.kind = OPND_NONE;
+    instr->op = instr->op == IR_LD ? IR_LD_IDX : IR_ST_IDX;
+}
+
+static void parseConditions(struct CompiledRule *rule)
+{
+    rule->deadRegs = 0;
+    rule->nextLabel = 0;
+    if (rule->rule->when == NULL) return;
+    const char *c = rule->rule->when;
+    while (*c != '\0') {
+        if (strncmp(c, "dead ", 5) == 0 && c[5] >= 'A' && c[5] < 'A' + REG_VARS) {
+            rule->deadRegs |= 1 << (c[5] - 'A');
+            c += 6;
+        } else if (strncmp(c, "next L", 6) == 0) {
+            rule->nextLabel = 1;
+            c += 6;
+        } else {
+            badRule(rule, "unknown condition");
+        }
+        if (strncmp(c, " / ", 3) == 0) c += 3;
+        else if (*c != '\0') badRule(rule, "unknown condition");
+    }
+}
+
+static void badRule(struct CompiledRule *rule, const char *why)
+{
+    fprintf(stderr, "Internal error: peephole rule \"%s\": %s\n", rule->rule->name, why);
+    exit(1);
+}
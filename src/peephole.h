@@ -0,0 +1,10 @@
+#ifndef SML_PEEPHOLE_H
+#define SML_PEEPHOLE_H
+
+#include <stdio.h>
+#include "ir.h"
+
+void peephole(struct IRProgram *prog);
+void printPeepholeStats(FILE *out);
+
+#endif
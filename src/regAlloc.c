@@ -0,0 +1,454 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ *
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Linear scan register allocation for a function's locals and parameters. SML can't take the
+ * address of a variable, so any of them can live in a register.
+ *
+ * Commands and expressions are numbered in the order codegen evaluates them, and every variable
+ * gets the live range from its declaration to its last use. A range that reaches into a loop
+ * from outside is stretched to the end of the loop, since the next iteration still needs it.
+ * Ranges are then handed registers in order of where they start. When there aren't enough, the
+ * one used least (uses in loops count for more) stays in memory.
+ *
+ * Registers for variables come off the top of the ones expressions use for temporaries, so the
+ * function gives up as many as it can while still evaluating its loops' expressions without
+ * spilling.
+ *
+ * r2 to r4 are callee saved: a function pushes the ones it uses, for variables or temporaries,
+ * on entry. r0, r1, r6 and r7 are the caller's problem, and r0 and r1 are always temporaries so
+ * a caller can put arguments in them.
+*/
+#include "regAlloc.h"
+#include "AST.h"
+#include "lex.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_VAR_REGS (LAST_VAR_REG - FIRST_VAR_REG + 1)
+#define MIN_TEMPS 2 // at least ARG_REGS
+// a variable has to be worth at least this many accesses to be given a register
+#define MIN_WEIGHT 3
+
+struct LiveRange {
+    struct ASTLinkedNode *decl;
+    int start;
+    int end;
+    int noInit; // declared without a value, so may read whatever the last iteration left
+    long weight;
+    int reg;
+};
+
+struct LoopSpan {
+    int start;
+    int end;
+};
+
+static struct LiveRange *ranges = NULL;
+static size_t rangeCount = 0;
+static size_t rangeCap = 0;
+static int *slotEnds = NULL; // by frame index, where the last variable given it stops being live
+static struct LoopSpan *loops = NULL;
+static size_t loopCount = 0;
+static size_t loopCap = 0;
+static int position;
+static int depth;
+static int loopNeed; // most temporaries an expression in a loop needs
+static int anyNeed;
+
+static void scan(struct ASTLinkedNode *node);
+static void scanExpr(struct ASTLinkedNode *expr);
+static void useVar(struct ASTLinkedNode *decl);
+static void addRange(struct ASTLinkedNode *decl, int noInit);
+static long depthWeight(void);
+static void extendOverLoops(void);
+static int compareStarts(const void *a, const void *b);
+static int isVariable(struct ASTLinkedNode *expr);
+
+/*
+ * REQUIRES: fnDecl has been through contextual analysis
+ * MODIFIES: every VAR_DECL of fnDecl's parameters and body
+ * EFFECTS: gives each variable of fnDecl a register in reg, or -1 and a frameIndex packed down
+ *   to just the locals left in memory, ones never live at the same time sharing (parameters
+ *   keep theirs, it's where the caller puts them).
+ *   Reports how the registers were split up in result.
+*/
+void allocateRegisters(struct ASTLinkedNode *fnDecl, struct RegAllocation *result)
+{
+    struct ASTLinkedNode *params = fnDecl->val.children->next, *child;
+    rangeCount = loopCount = 0;
+    position = depth = loopNeed = anyNeed = 0;
+
+    for (child = params->val.children; child != NULL; child = child->next) {
+        addRange(child, 0);
+        // it has to be loaded into its register once on entry
+        ranges[rangeCount - 1].weight = -1;
+    }
+    scan(params->next);
+    extendOverLoops();
+
+    int need = loopCount > 0 ? loopNeed : anyNeed;
+    if (need < MIN_TEMPS) need = MIN_TEMPS;
+    int available = LAST_VAR_REG + 1 - need;
+    if (available > MAX_VAR_REGS) available = MAX_VAR_REGS;
+    if (available < 0) available = 0;
+
+    // linear scan. ranges are sorted by start, active[] holds the ones currently in registers
+    qsort(ranges, rangeCount, sizeof(*ranges), compareStarts);
+    struct LiveRange *active[MAX_VAR_REGS];
+    int activeCount = 0;
+    for (size_t i = 0; i < rangeCount; i++) {
+        struct LiveRange *cur = &ranges[i];
+        cur->reg = -1;
+        if (cur->weight < MIN_WEIGHT || available == 0) continue;
+        for (int a = 0; a < activeCount;) {
+            if (active[a]->end < cur->start) {
+                active[a] = active[--activeCount];
+            } else {
+                a++;
+            }
+        }
+        if (activeCount < available) {
+            int used = 0;
+            for (int a = 0; a < activeCount; a++) used |= 1 << active[a]->reg;
+            int r = LAST_VAR_REG;
+            while (used & (1 << r)) r--;
+            cur->reg = r;
+            active[activeCount++] = cur;
+            continue;
+        }
+        // out of registers - whoever is used least goes to memory
+        int cheapest = 0;
+        for (int a = 1; a < activeCount; a++) {
+            if (active[a]->weight < active[cheapest]->weight) cheapest = a;
+        }
+        if (active[cheapest]->weight < cur->weight) {
+            cur->reg = active[cheapest]->reg;
+            active[cheapest]->reg = -1;
+            active[cheapest] = cur;
+        }
+    }
+
+    // temporaries only go as high as the function's expressions need, so the registers above
+    // are never touched and don't need saving
+    result->savedRegs = 0;
+    result->frameVars = 0;
+    result->regCeiling = anyNeed > MIN_TEMPS ? anyNeed : MIN_TEMPS;
+    if (result->regCeiling > LAST_VAR_REG + 1) result->regCeiling = LAST_VAR_REG + 1;
+    for (size_t i = 0; i < rangeCount; i++) {
+        struct ASTLinkedNode *decl = ranges[i].decl;
+        decl->val.reg = ranges[i].reg;
+        if (ranges[i].reg >= 0) {
+            result->savedRegs |= 1 << ranges[i].reg;
+            if (ranges[i].reg < result->regCeiling) result->regCeiling = ranges[i].reg;
+        }
+    }
+    for (int r = FIRST_VAR_REG; r < result->regCeiling; r++) {
+        result->savedRegs |= 1 << r;
+    }
+    // the locals left in memory are packed into the frame, sharing a word when they are never
+    // live at the same time (like the locals of two functions inlined one after the other)
+    for (size_t i = 0; i < rangeCount; i++) {
+        struct ASTLinkedNode *decl = ranges[i].decl;
+        if (decl->val.reg >= 0 || decl->val.isParam) continue;
+        int slot = 0;
+        while (slot < result->frameVars && slotEnds[slot] >= ranges[i].start) slot++;
+        if (slot == result->frameVars) result->frameVars++;
+        slotEnds[slot] = ranges[i].end;
+        decl->val.frameIndex = slot;
+    }
+}
+
+/*
+ * EFFECTS: returns how many registers, counting up from the one it ends up in, codegen uses to
+ *   evaluate expr without spilling. Variables are counted as if they are in registers.
+*/
+int tempsNeeded(struct ASTLinkedNode *expr)
+{
+    if (expr->val.type != EXPR) return 1;
+    struct ASTLinkedNode *left = expr->val.children, *right = left->next;
+    enum TokenType op = expr->val.operationType;
+    if (right == NULL) {
+        // *(x + 4) is a single ld off of x
+        if (op == DEREF && left->val.type == EXPR && left->val.operationType == PLUS) {
+            struct ASTLinkedNode *base = left->val.children;
+            if (isOffsetLiteral(base->next)) return tempsNeeded(base);
+            if (isOffsetLiteral(base)) return tempsNeeded(base->next);
+        }
+        return tempsNeeded(left);
+    }
+    int l = tempsNeeded(left), r = tempsNeeded(right);
+    if (op == AND || op == OR) {
+        return l > r ? l : r;
+    }
+    if (isOperandPreserving(op)) {
+        if (isVariable(right)) return l;
+        if (isVariable(left)) return r;
+    }
+    if (right->val.type == NUMBER_LITERAL && (op == TIMES || op == DIVIDE || op == MODULO
+            || op == LEFT_SHIFT || op == RIGHT_SHIFT)) {
+        return l;
+    }
+    if (left->val.type == NUMBER_LITERAL && op == TIMES) return r;
+    int need;
+    if (evaluatesRightFirst(expr)) {
+        need = r > l + 1 ? r : l + 1;
+    } else {
+        need = l > r + 1 ? l : r + 1;
+    }
+    if ((op == TIMES || op == DIVIDE || op == MODULO || op == LEFT_SHIFT || op == RIGHT_SHIFT)
+            && need < 3) {
+        // the long dynamic operations want a scratch register on top of r7
+        need = 3;
+    }
+    return need;
+}
+
+/*
+ * REQUIRES: expr is an infix operation
+ * EFFECTS: returns whether codegen evaluates expr's right operand before its left, because it
+ *   needs more registers and neither side has effects that would notice the order
+*/
+int evaluatesRightFirst(struct ASTLinkedNode *expr)
+{
+    struct ASTLinkedNode *left = expr->val.children, *right = left->next;
+    if (left->val.hasSideEffects || right->val.hasSideEffects) return 0;
+    return tempsNeeded(right) > tempsNeeded(left);
+}
+
+/*
+ * EFFECTS: returns whether codegen can apply op with its right operand still sitting in a
+ *   variable's register, because op only reads it
+*/
+int isOperandPreserving(enum TokenType op)
+{
+    switch (op) {
+    case PLUS:
+    case MINUS:
+    case BITWISE_AND:
+    case BITWISE_XOR:
+    case AND:
+    case OR:
+    case LESS_THAN:
+    case LESS_THAN_EQUALS:
+    case GREATER_THAN:
+    case GREATER_THAN_EQUALS:
+    case EQUALS:
+    case NOT_EQUALS:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * EFFECTS: numbers node and everything under it in evaluation order, recording live ranges,
+ *   loops, and how many temporaries expressions need
+*/
+static void scan(struct ASTLinkedNode *node)
+{
+    struct ASTLinkedNode *child;
+    int start;
+    if (node == NULL) return;
+    switch (node->val.type) {
+    case VAR_DECL:
+        if (node->val.children->next) {
+            scanExpr(node->val.children->next);
+        }
+        position++;
+        addRange(node, node->val.children->next == NULL);
+        return;
+    case DIRECT_ASSIGN:
+        scanExpr(node->val.children->next);
+        if (isVariable(node->val.children)) {
+            position++;
+            useVar(node->val.children->val.definition);
+        }
+        return;
+    case WHILE_LOOP:
+    case TAIL_LOOP:
+        start = position++;
+        depth++;
+        if (node->val.type == TAIL_LOOP) {
+            // tail calls write the parameters and branch back to the top
+            scan(node->val.children);
+        } else {
+            scanExpr(node->val.children);
+            scan(node->val.children->next);
+            // rotated loops test again at the bottom
+            scanExpr(node->val.children);
+        }
+        depth--;
+        if (loopCount == loopCap) {
+            loopCap = loopCap ? loopCap * 2 : 16;
+            loops = realloc(loops, loopCap * sizeof(*loops));
+            if (loops == NULL) {
+                fputs("Out of memory allocating registers\n", stderr);
+                exit(1);
+            }
+        }
+        loops[loopCount].start = start;
+        loops[loopCount].end = position++;
+        loopCount++;
+        return;
+    case IF_EXPR:
+        scanExpr(node->val.children);
+        scan(node->val.children->next);
+        if (node->val.children->next->next) scan(node->val.children->next->next);
+        return;
+    case RETURN_DIRECTIVE:
+        if (node->val.children) scanExpr(node->val.children);
+        return;
+    case INDIRECT_ASSIGN:
+        scanExpr(node->val.children);
+        scanExpr(node->val.children->next);
+        return;
+    case FUNC_CALL:
+        scanExpr(node);
+        return;
+    case CONST_DECL:
+        return;
+    default:
+        for (child = node->val.children; child != NULL; child = child->next) {
+            scan(child);
+        }
+        return;
+    }
+}
+
+static void scanExpr(struct ASTLinkedNode *expr)
+{
+    struct ASTLinkedNode *child;
+    switch (expr->val.type) {
+    case IDENT_REF:
+        if (isVariable(expr)) {
+            position++;
+            useVar(expr->val.definition);
+        }
+        return;
+    case FUNC_CALL:
+        for (child = expr->val.children->next->val.children; child != NULL; child = child->next) {
+            scanExpr(child);
+        }
+        return;
+    case EXPR:
+        for (child = expr->val.children; child != NULL; child = child->next) {
+            scanExpr(child);
+        }
+        int need = tempsNeeded(expr);
+        if (need > anyNeed) anyNeed = need;
+        if (depth > 0 && need > loopNeed) loopNeed = need;
+        return;
+    default:
+        return;
+    }
+}
+
+static void useVar(struct ASTLinkedNode *decl)
+{
+    // while scanning, reg holds the index of the decl's live range
+    struct LiveRange *range = &ranges[decl->val.reg];
+    range->end = position;
+    range->weight += depthWeight();
+}
+
+static void addRange(struct ASTLinkedNode *decl, int noInit)
+{
+    if (rangeCount == rangeCap) {
+        rangeCap = rangeCap ? rangeCap * 2 : 32;
+        ranges = realloc(ranges, rangeCap * sizeof(*ranges));
+        slotEnds = realloc(slotEnds, rangeCap * sizeof(*slotEnds));
+        if (ranges == NULL || slotEnds == NULL) {
+            fputs("Out of memory allocating registers\n", stderr);
+            exit(1);
+        }
+    }
+    struct LiveRange *range = &ranges[rangeCount];
+    range->decl = decl;
+    range->start = range->end = position;
+    range->noInit = noInit;
+    range->weight = noInit ? 0 : depthWeight();
+    range->reg = -1;
+    decl->val.reg = rangeCount++;
+}
+
+/*
+ * EFFECTS: returns roughly how many times code at the current loop depth runs per call
+*/
+static long depthWeight(void)
+{
+    long weight = 1;
+    for (int i = 0; i < depth && i < 4; i++) weight *= 8;
+    return weight;
+}
+
+/*
+ * EFFECTS: stretches every live range that is still needed around a loop's back edge to cover
+ *   the whole loop. Loops are recorded as they end, so inner loops come before the ones around
+ *   them and a range stretched to an inner loop's end still gets caught by the outer loop.
+*/
+static void extendOverLoops(void)
+{
+    for (size_t i = 0; i < rangeCount; i++) {
+        struct LiveRange *range = &ranges[i];
+        for (size_t l = 0; l < loopCount; l++) {
+            struct LoopSpan *loop = &loops[l];
+            if (range->start < loop->start && range->end >= loop->start && range->end < loop->end) {
+                range->end = loop->end;
+            } else if (range->noInit && range->start > loop->start && range->start < loop->end) {
+                range->start = loop->start;
+                if (range->end < loop->end) range->end = loop->end;
+            }
+        }
+    }
+}
+
+static int compareStarts(const void *a, const void *b)
+{
+    const struct LiveRange *x = a, *y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return x->decl < y->decl ? -1 : x->decl != y->decl;
+}
+
+static int isVariable(struct ASTLinkedNode *expr)
+{
+    return expr->val.type == IDENT_REF && expr->val.definition->val.type == VAR_DECL
+        && !expr->val.definition->val.isStatic;
+}
+
+/*
+ * EFFECTS: returns whether expr is a literal that fits in the offset of a ld / st
+*/
+int isOffsetLiteral(struct ASTLinkedNode *expr)
+{
+    return expr->val.type == NUMBER_LITERAL && expr->val.val >= 0 && expr->val.val <= 60
+        && expr->val.val % 4 == 0;
+}
+
+/*
+ * EFFECTS: returns whether expr reads nothing but constants and the function's own variables,
+ *   which no call can change (there is no taking their address)
+*/
+int onlyReadsLocals(struct ASTLinkedNode *expr)
+{
+    if (expr->val.isConstant || expr->val.type == NUMBER_LITERAL) return 1;
+    if (expr->val.type == IDENT_REF) return isVariable(expr);
+    if (expr->val.type != EXPR || expr->val.operationType == DEREF) return 0;
+    for (struct ASTLinkedNode *child = expr->val.children; child != NULL; child = child->next) {
+        if (!onlyReadsLocals(child)) return 0;
+    }
+    return 1;
+}
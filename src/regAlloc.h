@@ -0,0 +1,34 @@
+#ifndef SML_REG_ALLOC_H
+#define SML_REG_ALLOC_H
+
+#include "AST.h"
+
+#define FIRST_VAR_REG 2
+#define LAST_VAR_REG 4
+
+/*
+ * The calling convention: the first ARG_REGS arguments go in r0 and up, the rest in the words
+ * the caller's r5 points at, and the result comes back in r0. A callee keeps register arguments
+ * that don't get a variable register in their words too, so the caller leaves room for all of
+ * them. r2 to r4 are callee saved, r0, r1, r6 and r7 are caller saved.
+*/
+#define ARG_REGS 2
+
+/*
+ * Where allocateRegisters put a function's variables. Expression temporaries get r0 up to (but
+ * not including) regCeiling, variables get the registers from there up to r4.
+*/
+struct RegAllocation {
+    int regCeiling;
+    int savedRegs; // bit i set if the function uses callee saved ri, so has to preserve it
+    int frameVars; // words of frame for the variables that stayed in memory
+};
+
+void allocateRegisters(struct ASTLinkedNode *fnDecl, struct RegAllocation *result);
+int tempsNeeded(struct ASTLinkedNode *expr);
+int evaluatesRightFirst(struct ASTLinkedNode *expr);
+int isOperandPreserving(enum TokenType op);
+int isOffsetLiteral(struct ASTLinkedNode *expr);
+int onlyReadsLocals(struct ASTLinkedNode *expr);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2024 Aidan Undheim
+ *
+ * This file is part of SMLC.
+ *
+ * SMLC is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * SMLC is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * SMLC. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Turns self recursion into loops. A function that returns what a call to itself returns
+ * doesn't need its frame any more once the arguments are worked out, so instead of calling it
+ * can write them over its parameters and start its body again. The body goes in a TAIL_LOOP,
+ * and codegen makes every `return f(...)` of f inside it branch back to the top, so recursing
+ * like this takes no stack at all.
+ *
+ * `return n + f(n - 1)` isn't a tail call, there is still an addition to do once the call is
+ * back. But + doesn't care how it is grouped or ordered (and neither do *, &, | and ^), so the
+ * additions can just as well be done on the way down: the function gets an accumulator,
+ * starting at 0, that such returns add n to before tail calling, and every other return adds
+ * the accumulator to what it returns. When the call is the left operand the other one would
+ * have been evaluated after it, so it has to read nothing the call could change.
+*/
+#include "tailCall.h"
+#include "AST.h"
+#include "lex.h"
+#include "regAlloc.h"
+#include <stdio.h>
+
+static struct ASTLinkedNode *fn; // the function being looked at
+static int tailCalls; // returns that are already tail calls
+static int accumulations; // returns like n + f(n - 1)
+static int accumulateOp; // the operation they do, -1 if none yet
+static int canAccumulate; // only functions that return something
+static struct ASTLinkedNode *accumulator;
+
+static void eliminateInFunction(struct ASTLinkedNode *decl);
+static void classifyReturns(struct ASTLinkedNode *node);
+static void rewriteReturns(struct ASTLinkedNode *node);
+static struct ASTLinkedNode *accumulatedOperand(struct ASTLinkedNode *value, struct ASTLinkedNode **call);
+static int isSelfCall(struct ASTLinkedNode *expr);
+static int identityOf(enum TokenType op);
+static struct ASTLinkedNode *newNode(enum NodeType type, struct ASTLinkedNode *children);
+static struct ASTLinkedNode *accumulatorRef(void);
+static struct ASTLinkedNode *accumulate(struct ASTLinkedNode *value);
+static int makesCalls(struct ASTLinkedNode *node);
+
+/*
+ * REQUIRES: tree has been through contextual analysis (and inlining, which can turn mutual
+ *   recursion into self recursion)
+ * MODIFIES: tree
+ * EFFECTS: makes every function that returns the result of calling itself loop instead
+*/
+void eliminateTailCalls(struct AST *tree)
+{
+    for (struct ASTLinkedNode *global = tree->root->val.children; global != NULL; global = global->next) {
+        if (global->val.children->val.type == FN_DECL) eliminateInFunction(global->val.children);
+    }
+}
+
+static void eliminateInFunction(struct ASTLinkedNode *decl)
+{
+    struct ASTLinkedNode *body = decl->val.children->next->next;
+    fn = decl;
+    tailCalls = accumulations = 0;
+    accumulateOp = -1;
+    canAccumulate = !decl->val.isVoid;
+    classifyReturns(body);
+    if (tailCalls + accumulations == 0) return;
+
+    accumulator = NULL;
+    if (accumulations > 0) {
+        struct ASTLinkedNode *ident = newLinkedAstNode(IDENT_REF), *init = newLinkedAstNode(NUMBER_LITERAL);
+        init->val.val = identityOf(accumulateOp);
+        init->val.isConstant = 1;
+        ident->val.symbol = decl->val.symbol;
+        ident->val.definition = NULL;
+        ident->next = init;
+        accumulator = newNode(VAR_DECL, ident);
+        accumulator->val.symbol = decl->val.symbol;
+        accumulator->val.isParam = 0;
+        accumulator->val.reg = -1;
+        accumulator->val.frameIndex = decl->val.frameVars++;
+    }
+    rewriteReturns(body);
+
+    // the accumulator is set up once, outside the loop
+    struct ASTLinkedNode *loop = newNode(SINGLE_COMMAND, newNode(TAIL_LOOP, NULL)), *first = loop;
+    loop->val.children->val.children = treeAlloc(sizeof(*body));
+    *loop->val.children->val.children = *body;
+    if (accumulator != NULL) {
+        first = newNode(SINGLE_COMMAND, accumulator);
+        first->next = loop;
+    }
+    body->val.type = SINGLE_COMMAND;
+    body->val.children = newNode(COMMAND, first);
+    decl->val.clobbersReturn = makesCalls(body);
+}
+
+/*
+ * EFFECTS: counts the returns under node that are tail calls and the ones an accumulator could
+ *   make tail calls, picking the operation the accumulator does
+*/
+static void classifyReturns(struct ASTLinkedNode *node)
+{
+    struct ASTLinkedNode *call;
+    for (; node != NULL; node = node->next) {
+        // an inlined function's returns just leave its body
+        if (node->val.type == INLINED_CALL) continue;
+        if (node->val.type != RETURN_DIRECTIVE) {
+            classifyReturns(node->val.children);
+            continue;
+        }
+        if (node->val.children == NULL) continue;
+        if (isSelfCall(node->val.children)) {
+            tailCalls++;
+        } else if (canAccumulate && accumulatedOperand(node->val.children, &call) != NULL) {
+            // returns doing some other operation just get the accumulator combined with them
+            accumulateOp = node->val.children->val.operationType;
+            accumulations++;
+        }
+    }
+}
+
+/*
+ * EFFECTS: makes the returns under node that do the accumulated operation on a call to fn add
+ *   their other operand to the accumulator and tail call, and the rest return the accumulator
+ *   combined with what they returned before
+*/
+static void rewriteReturns(struct ASTLinkedNode *node)
+{
+    struct ASTLinkedNode *value, *call, *operand;
+    for (; node != NULL; node = node->next) {
+        if (node->val.type == INLINED_CALL) continue;
+        if (node->val.type != RETURN_DIRECTIVE) {
+            rewriteReturns(node->val.children);
+            continue;
+        }
+        value = node->val.children;
+        if (value == NULL || isSelfCall(value) || accumulator == NULL) continue;
+        operand = accumulatedOperand(value, &call);
+        if (operand == NULL) {
+            node->val.children = accumulate(value);
+            continue;
+        }
+        // accumulator = accumulator op operand, then return f(...)
+        struct ASTLinkedNode *target = accumulatorRef();
+        target->next = accumulate(operand);
+        struct ASTLinkedNode *update = newNode(SINGLE_COMMAND, newNode(DIRECT_ASSIGN, target));
+        call->next = NULL;
+        update->next = newNode(RETURN_DIRECTIVE, call);
+        node->val.type = SINGLE_COMMAND;
+        node->val.children = newNode(COMMAND, update);
+    }
+}
+
+/*
+ * EFFECTS: if value is a call to fn combined with something else by an operation an accumulator
+ *   can do, sets *call to the call and returns the something else. Otherwise returns NULL.
+*/
+static struct ASTLinkedNode *accumulatedOperand(struct ASTLinkedNode *value, struct ASTLinkedNode **call)
+{
+    if (value->val.type != EXPR || value->val.children->next == NULL) return NULL;
+    if (accumulateOp >= 0 && accumulateOp != (int)value->val.operationType) return NULL;
+    if (identityOf(value->val.operationType) < -1) return NULL;
+    struct ASTLinkedNode *left = value->val.children, *right = left->next;
+    if (isSelfCall(right)) {
+        // left was going to be evaluated before the call anyway
+        *call = right;
+        return left;
+    }
+    if (isSelfCall(left) && onlyReadsLocals(right)) {
+        *call = left;
+        return right;
+    }
+    return NULL;
+}
+
+static int isSelfCall(struct ASTLinkedNode *expr)
+{
+    return expr->val.type == FUNC_CALL && expr->val.children->val.definition == fn;
+}
+
+/*
+ * EFFECTS: returns x such that x op y is y for every y, or -2 if op doesn't work for an
+ *   accumulator
+*/
+static int identityOf(enum TokenType op)
+{
+    switch (op) {
+    case PLUS:
+    case BITWISE_OR:
+    case BITWISE_XOR:
+        return 0;
+    case TIMES:
+        return 1;
+    case BITWISE_AND:
+        return -1;
+    default:
+        return -2;
+    }
+}
+
+static struct ASTLinkedNode *newNode(enum NodeType type, struct ASTLinkedNode *children)
+{
+    struct ASTLinkedNode *node = newLinkedAstNode(type);
+    node->val.children = children;
+    return node;
+}
+
+static struct ASTLinkedNode *accumulatorRef(void)
+{
+    struct ASTLinkedNode *ref = newLinkedAstNode(IDENT_REF);
+    ref->val.symbol = accumulator->val.symbol;
+    ref->val.definition = accumulator;
+    return ref;
+}
+
+/*
+ * EFFECTS: returns the accumulator combined with value
+*/
+static struct ASTLinkedNode *accumulate(struct ASTLinkedNode *value)
+{
+    if (value->val.type == NUMBER_LITERAL && value->val.val == identityOf(accumulateOp)) {
+        return accumulatorRef();
+    }
+    struct ASTLinkedNode *expr = newNode(EXPR, accumulatorRef());
+    expr->val.operationType = accumulateOp;
+    expr->val.hasSideEffects = value->val.hasSideEffects;
+    expr->val.children->next = value;
+    value->next = NULL;
+    return expr;
+}
+
+/*
+ * EFFECTS: returns whether anything under node makes a call that isn't a tail call to fn
+*/
+static int makesCalls(struct ASTLinkedNode *node)
+{
+    for (; node != NULL; node = node->next) {
+        if (node->val.type == RETURN_DIRECTIVE && node->val.children != NULL && isSelfCall(node->val.children)) {
+            if (makesCalls(node->val.children->val.children->next)) return 1;
+            continue;
+        }
+        if (node->val.type == FUNC_CALL) return 1;
+        if (node->val.type != NUMBER_LITERAL && makesCalls(node->val.children)) return 1;
+    }
+    return 0;
+}
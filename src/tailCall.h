@@ -0,0 +1,8 @@
+#ifndef SML_TAIL_CALL_H
+#define SML_TAIL_CALL_H
+
+#include "AST.h"
+
+void eliminateTailCalls(struct AST *tree);
+
+#endif